@@ -85,7 +85,20 @@ Oid   BdrSupervisorDbOid = InvalidOid;
 
 /* GUC storage */
 static bool bdr_synchronous_commit;
+bool bdr_fast_catchup;
+bool bdr_stream_compression;
+bool bdr_stream_changed_columns;
 int bdr_default_apply_delay;
+int bdr_parallel_apply_workers;
+int bdr_apply_group_commit_xacts;
+int bdr_apply_group_commit_timeout;
+int bdr_apply_spool_memory;
+int bdr_apply_prefetch_depth;
+int bdr_apply_feedback_interval;
+int bdr_apply_feedback_distance;
+int bdr_apply_max_retries;
+int bdr_apply_received_data_limit;
+int bdr_stream_batch_size;
 int bdr_max_workers;
 int bdr_max_databases;
 static bool bdr_skip_ddl_replication;
@@ -94,6 +107,7 @@ bool bdr_do_not_replicate;
 bool bdr_trace_replay;
 int bdr_trace_ddl_locks_level;
 char *bdr_extra_apply_connection_options;
+char *bdr_binary_transfer_types;
 
 PG_MODULE_MAGIC;
 
@@ -108,6 +122,7 @@ PGDLLEXPORT Datum bdr_version_num(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum bdr_min_remote_version_num(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum bdr_variant(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum bdr_get_local_nodeid(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum bdr_get_apply_received(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum bdr_parse_slot_name_sql(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum bdr_parse_replident_name_sql(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum bdr_format_slot_name_sql(PG_FUNCTION_ARGS);
@@ -128,6 +143,7 @@ PG_FUNCTION_INFO_V1(bdr_version_num);
 PG_FUNCTION_INFO_V1(bdr_min_remote_version_num);
 PG_FUNCTION_INFO_V1(bdr_variant);
 PG_FUNCTION_INFO_V1(bdr_get_local_nodeid);
+PG_FUNCTION_INFO_V1(bdr_get_apply_received);
 PG_FUNCTION_INFO_V1(bdr_parse_slot_name_sql);
 PG_FUNCTION_INFO_V1(bdr_parse_replident_name_sql);
 PG_FUNCTION_INFO_V1(bdr_format_slot_name_sql);
@@ -494,6 +510,18 @@ bdr_bgworker_init(uint32 worker_arg, BdrWorkerType worker_type)
 	CommitTransactionCommand();
 	bdr_executor_always_allow_writes(false);
 
+	bdr_bgworker_set_session_options(worker_type);
+}
+
+/*
+ * Set up the session options all bdr workers of the given type run with.
+ *
+ * Also used by the parallel apply workers, which connect to the database
+ * without a shmem slot of their own.
+ */
+void
+bdr_bgworker_set_session_options(BdrWorkerType worker_type)
+{
 	/* always work in our own schema */
 	SetConfigOption("search_path", "bdr, pg_catalog",
 					PGC_BACKEND, PGC_S_OVERRIDE);
@@ -518,7 +546,6 @@ bdr_bgworker_init(uint32 worker_arg, BdrWorkerType worker_type)
 	 */
 	SetConfigOption("check_function_bodies", "off",
 					PGC_INTERNAL, PGC_S_OVERRIDE);
-
 }
 
 /*
@@ -757,6 +784,33 @@ _PG_init(void)
 							 0,
 							 NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("bdr.fast_catchup",
+							 "Replay changes in batches without synchronous commit while catching up during a join",
+							 NULL,
+							 &bdr_fast_catchup,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("bdr.stream_compression",
+							 "Ask upstream nodes to compress the changes they send",
+							 NULL,
+							 &bdr_stream_compression,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("bdr.stream_changed_columns",
+							 "Ask upstream nodes to send only the changed columns of updates where they can",
+							 NULL,
+							 &bdr_stream_changed_columns,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
 	DefineCustomBoolVariable("bdr.log_conflicts_to_table",
 							 "Log BDR conflicts to bdr.conflict_history table",
 							 NULL,
@@ -820,6 +874,96 @@ _PG_init(void)
 							GUC_UNIT_MS,
 							NULL, NULL, NULL);
 
+	DefineCustomIntVariable("bdr.parallel_apply_workers",
+							"Number of additional processes each apply worker uses to apply independent transactions concurrently",
+							"0 applies all changes in the apply worker itself",
+							&bdr_parallel_apply_workers,
+							0, 0, 64,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_group_commit_xacts",
+							"Max number of remote transactions applied in one local transaction",
+							"1 commits each remote transaction separately",
+							&bdr_apply_group_commit_xacts,
+							1, 1, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_group_commit_timeout",
+							"Max time remote transactions are kept uncommitted in a group commit",
+							NULL,
+							&bdr_apply_group_commit_timeout,
+							100, 0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_spool_memory",
+							"Memory used to queue received changes until they can be applied",
+							"0 applies changes as they are received. Changes exceeding it are queued in a temporary file.",
+							&bdr_apply_spool_memory,
+							0, 0, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_prefetch_depth",
+							"Number of received changes to prefetch the rows of while applying earlier ones",
+							"0 disables prefetching",
+							&bdr_apply_prefetch_depth,
+							0, 0, 1000,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_feedback_interval",
+							"Max time between replies to the upstream while applying is behind",
+							"0 replies whenever there's progress to report",
+							&bdr_apply_feedback_interval,
+							1000, 0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_feedback_distance",
+							"Flush progress after which to reply to the upstream before bdr.apply_feedback_interval elapsed",
+							"0 disables replying based on progress",
+							&bdr_apply_feedback_distance,
+							16384, 0, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_max_retries",
+							"Number of times in a row apply workers retry after transient errors before restarting",
+							"0 restarts the worker after every error",
+							&bdr_apply_max_retries,
+							10, 0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.apply_received_data_limit",
+							"Size of the changes apply workers receive in one go before applying them and freeing the memory they were received into",
+							"0 means no limit",
+							&bdr_apply_received_data_limit,
+							65536, 0, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.stream_batch_size",
+							"Ask upstream nodes to send changes in batches of up to this size",
+							"0 sends every change on its own",
+							&bdr_stream_batch_size,
+							0, 0, 65536,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
 	DefineCustomIntVariable("bdr.max_ddl_lock_delay",
 							"Sets the maximum delay before canceling queries while waiting for global lock",
 							"If se to -1 max_standby_streaming_delay will be used",
@@ -889,6 +1033,15 @@ _PG_init(void)
 							   0,
 							   NULL, NULL, NULL);
 
+	DefineCustomStringVariable("bdr.binary_transfer_types",
+							   "Non-builtin types to send in their in-memory representation to peers of the same architecture",
+							   "Comma separated list of schema-qualified type names.",
+							   &bdr_binary_transfer_types,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_LIST_INPUT,
+							   NULL, NULL, NULL);
+
 	EmitWarningsOnPlaceholders("bdr");
 
 	bdr_label_init();
@@ -1111,6 +1264,78 @@ bdr_get_local_nodeid(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(HeapTupleGetDatum(returnTuple));
 }
 
+/*
+ * Size of the changes the apply workers in this database have received but
+ * not applied yet, to size hosts with many peers. That's the size of the
+ * messages, not of the memory allocated for them, which isn't tracked.
+ */
+Datum
+bdr_get_apply_received(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	int			i;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(BdrWorkerCtl->lock, LW_SHARED);
+	for (i = 0; i < bdr_max_workers; i++)
+	{
+		BdrWorker  *w = &BdrWorkerCtl->slots[i];
+		BdrApplyWorker *apply = &w->data.apply;
+		Datum		values[8];
+		bool		nulls[8];
+		char		sysid_str[33];
+
+		if (w->worker_type != BDR_WORKER_APPLY ||
+			apply->dboid != MyDatabaseId)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		snprintf(sysid_str, sizeof(sysid_str), UINT64_FORMAT,
+				 apply->remote_sysid);
+		sysid_str[sizeof(sysid_str)-1] = '\0';
+
+		values[0] = Int32GetDatum(w->worker_pid);
+		nulls[0] = (w->worker_pid == 0);
+		values[1] = CStringGetTextDatum(sysid_str);
+		values[2] = ObjectIdGetDatum(apply->remote_timeline);
+		values[3] = ObjectIdGetDatum(apply->remote_dboid);
+		values[4] = Int64GetDatum((int64) apply->received_bytes);
+		values[5] = Int64GetDatum((int64) apply->queued_bytes);
+		values[6] = Int64GetDatum((int64) apply->spooled_bytes);
+		values[7] = Int64GetDatum((int64) apply->received_resets);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(BdrWorkerCtl->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
 Datum
 bdr_parse_slot_name_sql(PG_FUNCTION_ARGS)
 {
@@ -10,10 +10,13 @@
 #ifndef BDR_H
 #define BDR_H
 
+#include "fmgr.h"
+
 #include "access/xlogdefs.h"
 #include "postmaster/bgworker.h"
 #include "replication/logical.h"
 #include "utils/resowner.h"
+#include "storage/block.h"
 #include "storage/latch.h"
 #include "storage/lock.h"
 
@@ -68,6 +71,24 @@ typedef enum BdrOutputBeginFlags
 	BDR_OUTPUT_TRANSACTION_HAS_ORIGIN = 1
 } BdrOutputBeginFlags;
 
+/*
+ * Flags to indicate which fields are present in a relation metadata record
+ * sent by the output plugin.
+ */
+typedef enum BdrOutputRelationFlags
+{
+	/* names of the types whose oids the relation's send/recv data embeds */
+	BDR_OUTPUT_RELATION_HAS_TYPES = 1
+} BdrOutputRelationFlags;
+
+/*
+ * Oldest client version that understands relation metadata ('R') messages
+ * and changes that identify their relation by the upstream's oid instead of
+ * by name. The output plugin only uses that format for clients at least this
+ * new.
+ */
+#define BDR_MIN_RELMETA_VERSION_NUM 10003
+
 /*
  * BDR conflict detection: type of conflict that was identified.
  *
@@ -122,6 +143,63 @@ enum BdrDDLLockTraceLevel {
 	DDL_LOCK_TRACE_NONE
 };
 
+struct BDRApplyRelState;
+
+/*
+ * A decoded remote tuple. The arrays have one entry per attribute of the
+ * relation the tuple belongs to.
+ */
+typedef struct BDRTupleData
+{
+	Datum	   *values;
+	bool	   *isnull;
+	bool	   *changed;
+} BDRTupleData;
+
+/*
+ * Per-attribute information needed to decode the columns of a remote tuple,
+ * so read_tuple_parts() doesn't have to do catalog lookups for every datum.
+ * The function info for the receive/input functions is only looked up once a
+ * column has been sent in the respective format.
+ */
+typedef struct BDRAttrDecodeInfo
+{
+	int32		typmod;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	bool		recv_valid;
+	Oid			recv_typioparam;
+	FmgrInfo	recv_finfo;
+
+	bool		input_valid;
+	Oid			input_typioparam;
+	FmgrInfo	input_finfo;
+
+	/* send/recv data embeds oids of non-builtin types, see remap_type_oids */
+	bool		recv_remap;
+} BDRAttrDecodeInfo;
+
+/*
+ * Per-attribute information the output plugin needs to send the columns of a
+ * tuple, so write_tuple() doesn't have to do catalog lookups or set up the
+ * send/output function for every datum.
+ */
+typedef struct BDRAttrEncodeInfo
+{
+	/* wire format: 'b'inary, 's'end/recv or 't'ext */
+	char		format;
+	int16		typlen;
+	bool		typbyval;
+
+	/* part of a unique index, always sent */
+	bool		iskey;
+
+	/* send or output function, unless sent in binary */
+	FmgrInfo	finfo;
+} BDRAttrEncodeInfo;
+
 /*
  * This structure is for caching relation specific information, such as
  * conflict handlers.
@@ -147,14 +225,82 @@ typedef struct BDRRelation
 	bool		computed_repl_insert;
 	bool		computed_repl_update;
 	bool		computed_repl_delete;
+
+	/*
+	 * Memory for information derived from the relation's definition, deleted
+	 * when the entry is invalidated.
+	 */
+	MemoryContext cache_cxt;
+
+	/* decoding information, one per attribute, see bdr_relcache_decode_info */
+	BDRAttrDecodeInfo *decode_info;
+	/* buffers to decode a remote tuple's old key and new tuple into */
+	BDRTupleData decode_old;
+	BDRTupleData decode_new;
+
+	/*
+	 * Output plugin encoding information, in a child of cache_cxt; only valid
+	 * while encode_generation matches the output plugin's, see
+	 * prepare_encode_info().
+	 */
+	MemoryContext encode_cxt;
+	uint32		encode_generation;
+	/* one per attribute */
+	BDRAttrEncodeInfo *encode_info;
+	/* schema and relation name, lengths include the terminating NUL */
+	char	   *encode_nspname;
+	int			encode_nspnamelen;
+	char	   *encode_relname;
+	int			encode_relnamelen;
+	/* non-builtin types whose oids the send/recv data of columns embeds */
+	Oid		   *encode_types;
+	int			encode_ntypes;
+	/* TYPEOID syscache hash values of column types and encode_types */
+	uint32	   *encode_typhashes;
+	int			encode_ntyphashes;
+	/* changes whenever the encoding information is rebuilt */
+	uint32		encode_build;
+
+	/* index lookup scan keys, see build_index_scan_key */
+	struct BDRScanKeyTemplate *scankey_templates;
+
+	/* executor state used by the apply worker, only valid within a xact */
+	struct BDRApplyRelState *apply_state;
 } BDRRelation;
 
-typedef struct BDRTupleData
+/*
+ * Executor state the apply worker keeps for each relation it modifies in the
+ * current transaction, so it doesn't have to set up an EState, open the
+ * relation's indexes and create tuple slots for every replicated change.
+ *
+ * Allocated in TopTransactionContext; see bdr_apply_relstate_get().
+ */
+typedef struct BDRApplyRelState
 {
-	Datum		values[MaxTupleAttributeNumber];
-	bool		isnull[MaxTupleAttributeNumber];
-	bool		changed[MaxTupleAttributeNumber];
-} BDRTupleData;
+	dlist_node	node;
+
+	BDRRelation *bdrrel;
+
+	struct EState *estate;
+	struct TupleTableSlot *newslot;
+	struct TupleTableSlot *oldslot;
+
+	/* the opened replica identity index, if any, from estate's indexes */
+	Relation	replident_index;
+
+	/*
+	 * Can remote INSERTs be written before checking for conflicts? See
+	 * UserTableTryInsertOpenIndexes().
+	 */
+	bool		optimistic_insert;
+
+	/*
+	 * SnapshotDirty scans on estate's indexes for find_pkey_tuple(), started
+	 * on first use and only rescanned afterwards.
+	 */
+	struct IndexScanDescData **index_scans;
+	struct SnapshotData *dirty_snapshot;
+} BDRApplyRelState;
 
 /*
  * BdrApplyWorker describes a BDR worker connection.
@@ -189,12 +335,27 @@ typedef struct BdrApplyWorker
 	/* Request that the remote forward all changes from other nodes */
 	bool forward_changesets;
 
+	/*
+	 * Replay up to replay_stop_lsn with the fast catchup profile, see
+	 * bdr.fast_catchup.
+	 */
+	bool fast_catchup;
+
 	/*
 	 * The apply worker's latch from the PROC array, for use from other backends
 	 *
 	 * Must only be accessed with the bdr worker shmem control segment lock held.
 	 */
 	Latch			*proclatch;
+
+	/*
+	 * Size of the changes the worker holds, see bdr_get_apply_received().
+	 * Only written by the worker itself, read without locking.
+	 */
+	Size		received_bytes;
+	Size		queued_bytes;
+	Size		spooled_bytes;
+	uint64		received_resets;
 } BdrApplyWorker;
 
 /*
@@ -284,10 +445,23 @@ typedef struct BdrWorker
 
 /* GUCs */
 extern int	bdr_default_apply_delay;
+extern int	bdr_parallel_apply_workers;
+extern int	bdr_apply_group_commit_xacts;
+extern int	bdr_apply_group_commit_timeout;
+extern int	bdr_apply_spool_memory;
+extern int	bdr_apply_prefetch_depth;
+extern int	bdr_apply_feedback_interval;
+extern int	bdr_apply_feedback_distance;
+extern int	bdr_apply_max_retries;
+extern int	bdr_apply_received_data_limit;
+extern int	bdr_stream_batch_size;
 extern int bdr_max_workers;
 extern int bdr_max_databases;
 extern char *bdr_temp_dump_directory;
 extern bool bdr_log_conflicts_to_table;
+extern bool bdr_fast_catchup;
+extern bool bdr_stream_compression;
+extern bool bdr_stream_changed_columns;
 extern bool bdr_conflict_logging_include_tuples;
 extern bool bdr_permit_ddl_locking;
 extern bool bdr_permit_unsafe_commands;
@@ -298,6 +472,7 @@ extern int bdr_ddl_lock_timeout;
 extern bool bdr_trace_replay;
 extern int bdr_trace_ddl_locks_level;
 extern char *bdr_extra_apply_connection_options;
+extern char *bdr_binary_transfer_types;
 
 static const char * const bdr_default_apply_connection_options =
         "connect_timeout=30 "
@@ -392,15 +567,24 @@ extern void UserTableUpdateIndexes(struct EState *estate,
 								   struct TupleTableSlot *slot);
 extern void UserTableUpdateOpenIndexes(struct EState *estate,
 									   struct TupleTableSlot *slot);
-extern void build_index_scan_keys(struct EState *estate,
+extern bool UserTableTryInsertOpenIndexes(struct EState *estate,
+										  struct TupleTableSlot *slot);
+extern void build_index_scan_keys(BDRRelation *rel,
+								  struct EState *estate,
 								  struct ScanKeyData **scan_keys,
 								  BDRTupleData *tup);
-extern bool build_index_scan_key(struct ScanKeyData *skey, Relation rel,
+extern bool build_index_scan_key(struct ScanKeyData *skey, BDRRelation *rel,
 								 Relation idxrel,
 								 BDRTupleData *tup);
 extern bool find_pkey_tuple(struct ScanKeyData *skey, BDRRelation *rel,
 							Relation idxrel, struct TupleTableSlot *slot,
 							bool lock, enum LockTupleMode mode);
+extern int prefetch_pkey_tuple(struct ScanKeyData *skey, BDRRelation *rel,
+							   Relation idxrel, BlockNumber *blocks,
+							   int maxblocks);
+extern BDRApplyRelState *bdr_apply_relstate_get(BDRRelation *rel);
+extern void bdr_apply_relstate_release(BDRRelation *rel);
+extern void bdr_apply_relstate_release_all(void);
 
 /* conflict logging (usable in apply only) */
 
@@ -480,6 +664,13 @@ extern void bdr_count_update_conflict(void);
 extern void bdr_count_delete(void);
 extern void bdr_count_delete_conflict(void);
 extern void bdr_count_disconnect(void);
+extern void bdr_count_prefetch(void);
+extern void bdr_count_prefetch_hit(void);
+extern void bdr_count_feedback(void);
+extern void bdr_count_retry_connection(void);
+extern void bdr_count_retry_conflict(void);
+extern void bdr_count_retry_lock(void);
+extern void bdr_count_compressed(Size compressed, Size raw);
 
 /* compat check functions */
 extern bool bdr_get_float4byval(void);
@@ -495,6 +686,17 @@ extern void bdr_maintain_schema(bool update_extensions);
 /* shared memory management */
 extern void bdr_shmem_init(void);
 
+/* node identity registry, bdr_node_identity.c */
+extern void bdr_node_identity_shmem_init(void);
+extern uint32 bdr_node_identity_generation(void);
+extern uint32 bdr_node_identity_fill(void);
+extern bool bdr_node_identity_get(RepNodeId node_id, uint64 *sysid,
+								  TimeLineID *timeline, Oid *dboid,
+								  Oid *local_dboid);
+extern void bdr_node_identity_set(RepNodeId node_id, uint32 generation,
+								  uint64 sysid, TimeLineID timeline,
+								  Oid dboid, Oid local_dboid);
+
 extern BdrWorker* bdr_worker_shmem_alloc(BdrWorkerType worker_type,
 										 uint32 *ctl_idx);
 extern void bdr_worker_shmem_free(BdrWorker* worker, BackgroundWorkerHandle *handle);
@@ -527,8 +729,43 @@ extern void bdr_locks_check_dml(void);
 PGDLLEXPORT extern void bdr_apply_main(Datum main_arg);
 PGDLLEXPORT extern void bdr_perdb_worker_main(Datum main_arg);
 PGDLLEXPORT extern void bdr_supervisor_worker_main(Datum main_arg);
+PGDLLEXPORT extern void bdr_apply_parallel_worker_main(Datum main_arg);
+
+/* apply, bdr_apply.c */
+extern void bdr_process_remote_action(StringInfo s);
+extern void bdr_flush_position_add(XLogRecPtr local_end,
+								   XLogRecPtr remote_end);
+extern void bdr_apply_attach_worker(BdrApplyWorker *apply);
+extern void bdr_apply_reset_state(void);
+
+/* parallel apply, bdr_apply_parallel.c */
+extern bool bdr_apply_parallel_is_worker;
+extern bool bdr_apply_parallel_active(void);
+extern void bdr_apply_parallel_start(int nworkers, RepNodeId replication_identifier);
+extern void bdr_apply_parallel_dispatch(StringInfo s);
+extern void bdr_apply_parallel_collect(void);
+extern void bdr_apply_parallel_receive(StringInfo s);
+extern void bdr_apply_parallel_pump(void);
+extern bool bdr_apply_parallel_has_pending(void);
+extern void bdr_apply_parallel_xact_started(void);
+extern void bdr_apply_parallel_wait_turn(void);
+extern void bdr_apply_parallel_commit_done(XLogRecPtr remote_end,
+										   XLogRecPtr local_end);
+
+/* apply spools, bdr_apply_spool.c */
+typedef struct BdrApplySpool BdrApplySpool;
+
+extern bool bdr_apply_spool_enabled(void);
+extern BdrApplySpool *bdr_apply_receive_spool(void);
+extern BdrApplySpool *bdr_apply_spool_create(const char *name, int *memory_kb);
+extern bool bdr_apply_spool_is_empty(BdrApplySpool *spool);
+extern void bdr_apply_spool_put(BdrApplySpool *spool, const char *data,
+								int len);
+extern bool bdr_apply_spool_get(BdrApplySpool *spool, StringInfo msg);
+extern Size bdr_apply_spool_memory_used(BdrApplySpool *spool);
 
 extern void bdr_bgworker_init(uint32 worker_arg, BdrWorkerType worker_type);
+extern void bdr_bgworker_set_session_options(BdrWorkerType worker_type);
 extern void bdr_supervisor_register(void);
 
 extern Oid bdr_get_supervisordb_oid(bool missing_ok);
@@ -614,12 +851,17 @@ extern void bdr_heap_compute_replication_settings(
 	int			num_replication_sets,
 	char	  **replication_sets);
 extern void BDRRelcacheHashInvalidateCallback(Datum arg, Oid relid);
+extern MemoryContext bdr_relcache_cxt(BDRRelation *rel);
+extern BDRAttrDecodeInfo *bdr_relcache_decode_info(BDRRelation *rel);
+extern void bdr_relcache_invalidate_encode_info(uint32 typhash);
+extern List *bdr_embedded_user_types(Oid typid);
 
 extern void bdr_parse_relation_options(const char *label, BDRRelation *rel);
 extern void bdr_parse_database_options(const char *label, bool *is_active);
 
 /* conflict handlers API */
 extern void bdr_conflict_handlers_init(void);
+extern void bdr_get_conflict_handlers(BDRRelation * rel);
 
 extern HeapTuple bdr_conflict_handlers_resolve(BDRRelation * rel,
 											   const HeapTuple local,
@@ -14,6 +14,8 @@
  */
 #include "postgres.h"
 
+#include <arpa/inet.h>
+
 #include "bdr.h"
 #include "bdr_locks.h"
 
@@ -25,6 +27,7 @@
 #include "access/committs.h"
 #include "access/htup_details.h"
 #include "access/relscan.h"
+#include "access/transam.h"
 #include "access/xact.h"
 
 #include "catalog/catversion.h"
@@ -39,6 +42,8 @@
 
 #include "mb/pg_wchar.h"
 
+#include "nodes/makefuncs.h"
+
 #include "parser/parse_type.h"
 
 #include "replication/logical.h"
@@ -56,8 +61,10 @@
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/datetime.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/pg_lzcompress.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
 
@@ -90,6 +97,36 @@ static XLogRecPtr		remote_origin_lsn = InvalidXLogRecPtr;
 /* The local identifier for the remote's origin, if any. */
 static RepNodeId		remote_origin_id = InvalidRepNodeId;
 
+/*
+ * Remote transactions applied in the still open local transaction, see
+ * group_commit_continue().
+ */
+static int				group_commit_xacts = 0;
+static TimestampTz		group_commit_start = 0;
+static XLogRecPtr		group_commit_end_lsn = InvalidXLogRecPtr;
+/* origin commit lsn and timestamp of the last remote transaction in it */
+static XLogRecPtr		group_commit_origin_lsn = InvalidXLogRecPtr;
+static TimestampTz		group_commit_origin_timestamp = 0;
+/* set if the local transaction has to be committed with this one */
+static bool				group_commit_unsafe = false;
+
+/*
+ * Catching up to replay_stop_lsn during a join with bdr.fast_catchup. A
+ * failed join is started over, so replay needn't be durable before it's
+ * done: commits are asynchronous and grouped, and everything is flushed
+ * once when replay_stop_lsn is reached.
+ */
+static bool				fast_catchup = false;
+#define BDR_CATCHUP_GROUP_COMMIT_XACTS		1000
+#define BDR_CATCHUP_GROUP_COMMIT_TIMEOUT	1000
+/* log catchup progress this often, in ms */
+#define BDR_CATCHUP_PROGRESS_INTERVAL		10000
+
+static TimestampTz		catchup_start = 0;
+static TimestampTz		catchup_last_progress = 0;
+static uint64			catchup_xacts = 0;
+static XLogRecPtr		catchup_start_lsn = InvalidXLogRecPtr;
+
 /*
  * A message counter for the xact, for debugging. We don't send
  * the remote change LSN with messages, so this aids identification
@@ -105,7 +142,163 @@ static BdrApplyWorker *bdr_apply_worker = NULL;
 
 static BdrConnectionConfig *bdr_apply_config = NULL;
 
-dlist_head bdr_lsn_association = DLIST_STATIC_INIT(bdr_lsn_association);
+/*
+ * Ends of applied remote commits and of the local commits applying them,
+ * oldest first, so the upstream can be told how far changes have been
+ * flushed. A ring buffer; when it's full the newest entry is advanced
+ * instead of adding one, which only makes the commits it covers wait for a
+ * later local flush to be confirmed.
+ */
+#define BDR_FLUSH_POSITIONS		1024
+
+static BdrFlushPosition flush_positions[BDR_FLUSH_POSITIONS];
+static int		flush_positions_oldest = 0;
+static int		flush_positions_count = 0;
+
+/*
+ * Upstream relations we've received relation metadata ('R') messages for,
+ * keyed by the upstream's oid for the relation. Changes then only carry the
+ * oid, see read_rel().
+ */
+typedef struct BdrRemoteRelation
+{
+	Oid			remote_relid;	/* hash key */
+	NameData	nspname;
+	NameData	relname;
+	/* local relation, InvalidOid if not looked up since last invalidation */
+	Oid			local_relid;
+} BdrRemoteRelation;
+
+static HTAB *BdrRemoteRelations = NULL;
+
+/*
+ * Upstream types whose oids are embedded in the send/recv data of arrays and
+ * composites, keyed by the upstream's oid for the type. Their names come
+ * with the metadata of the relations using them, see read_remote_types().
+ */
+typedef struct BdrRemoteType
+{
+	Oid			remote_typid;	/* hash key */
+	NameData	nspname;
+	NameData	typname;
+	/* local type, InvalidOid if not looked up since last invalidation */
+	Oid			local_typid;
+} BdrRemoteType;
+
+static HTAB *BdrRemoteTypes = NULL;
+
+/*
+ * Local RepNodeIds of the nodes transactions forwarded by the upstream
+ * originated on, so we don't have to look up the replication identifier in
+ * a transaction of its own for every forwarded transaction.
+ */
+typedef struct BdrForwardedOriginKey
+{
+	uint64		sysid;
+	TimeLineID	timeline;
+	Oid			dboid;
+} BdrForwardedOriginKey;
+
+typedef struct BdrForwardedOrigin
+{
+	BdrForwardedOriginKey key;	/* hash key */
+	RepNodeId	node_id;
+} BdrForwardedOrigin;
+
+static HTAB *BdrForwardedOrigins = NULL;
+
+/*
+ * Remote INSERTs into one relation that haven't been written yet, so a run
+ * of them can be written with heap_multi_insert(). Any other action writes
+ * them first. Limits as in COPY.
+ */
+#define BDR_INSERT_BATCH_TUPLES		1000
+#define BDR_INSERT_BATCH_BYTES		65535
+
+static Oid		insert_batch_relid = InvalidOid;
+static HeapTuple insert_batch_tuples[BDR_INSERT_BATCH_TUPLES];
+static int		insert_batch_ntuples = 0;
+static Size		insert_batch_bytes = 0;
+static MemoryContext InsertBatchContext = NULL;
+
+/*
+ * Each batch is written in a subtransaction, see insert_batch_flush(). Every
+ * one of them gets an xid, and once a transaction has more subxids than
+ * PGPROC caches, building snapshots gets slow for everyone, so past this
+ * many in one local transaction (e.g. with group commit) batches are written
+ * the slow way.
+ */
+#define BDR_INSERT_BATCH_MAX_SUBXACTS	32
+
+static int		insert_batch_subxacts = 0;
+static LocalTransactionId insert_batch_subxacts_lxid = InvalidLocalTransactionId;
+
+/*
+ * Changes received but not applied yet, up to bdr.apply_prefetch_depth, so
+ * the heap blocks of the rows upcoming UPDATEs and DELETEs will modify can
+ * be prefetched while earlier changes are applied. The messages live in
+ * MessageContext, so the queue is emptied before that's reset.
+ */
+static List	   *lookahead_msgs = NIL;
+/* leading queue entries prefetch_lookahead() already looked at */
+static int		lookahead_prefetched = 0;
+
+/* recently prefetched heap blocks, to count the lookups they were useful for */
+#define BDR_PREFETCH_BLOCKS			1024
+#define BDR_PREFETCH_BLOCKS_PER_ROW	4
+
+typedef struct BdrPrefetchedBlock
+{
+	Oid			relid;
+	BlockNumber	blkno;
+} BdrPrefetchedBlock;
+
+static BdrPrefetchedBlock prefetched_blocks[BDR_PREFETCH_BLOCKS];
+static int		prefetched_blocks_next = 0;
+
+/*
+ * Changes received but held back by the apply delay. The oldest one is kept
+ * in delay_head until it can be applied; a BEGIN is due once its commit
+ * timestamp is apply_delay old, everything behind it is applied along.
+ */
+static BdrApplySpool *delay_queue = NULL;
+static StringInfoData delay_head;
+static bool		delay_head_valid = false;
+
+/*
+ * Memory for applying a single change, reset after each one, so allocations
+ * made while applying don't pile up in MessageContext for a whole receive
+ * pass, which can span thousands of transactions while catching up.
+ */
+static MemoryContext ApplyChangeContext = NULL;
+
+/*
+ * Size of the changes received since MessageContext was last reset, as an
+ * estimate of its size. Once it exceeds bdr.apply_received_data_limit, the queued
+ * changes are applied and MessageContext is reset without waiting for the
+ * receive pass to end.
+ */
+static Size		message_bytes = 0;
+static uint64	message_forced_resets = 0;
+
+/* size of the messages in lookahead_msgs */
+static Size		lookahead_bytes = 0;
+
+/*
+ * Latest position received from the upstream. Forgotten when streaming is
+ * restarted after an error, as the changes received but not applied are
+ * lost then.
+ */
+static XLogRecPtr last_recvpos = InvalidXLogRecPtr;
+
+/* where streaming was last started, to tell whether applying made progress */
+static XLogRecPtr apply_start_lsn = InvalidXLogRecPtr;
+
+/* delays before retrying after an error, see bdr_apply_retry() */
+#define BDR_APPLY_RETRY_MIN_DELAY			100L
+#define BDR_APPLY_RETRY_MAX_DELAY			5000L
+/* time to wait for the walsender to end streaming to reuse the connection */
+#define BDR_APPLY_STOP_STREAMING_TIMEOUT	5000
 
 struct ActionErrCallbackArg
 {
@@ -118,6 +311,8 @@ struct ActionErrCallbackArg
 
 static BDRRelation *read_rel(StringInfo s, LOCKMODE mode, struct ActionErrCallbackArg *cbarg);
 static void read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup);
+static void fill_unchanged_columns(BDRRelation *rel, BDRTupleData *new_tuple,
+								   BDRTupleData *old_tuple);
 
 static void check_apply_update(BdrConflictType conflict_type,
 							   RepNodeId local_node_id, TimestampTz local_ts,
@@ -127,9 +322,32 @@ static void check_apply_update(BdrConflictType conflict_type,
 							   BdrConflictResolution *resolution);
 
 static void check_bdr_wakeups(BDRRelation *rel);
+static bool insert_batch_eligible(BDRRelation *rel,
+								  BDRApplyRelState *relstate);
+static void insert_batch_add(BDRRelation *rel, HeapTuple tuple);
+static void insert_batch_flush(BDRRelation *open_rel);
+static bool insert_checked(BDRRelation *rel, BDRApplyRelState *relstate,
+						   BDRTupleData *new_tuple);
+static int	current_apply_delay(void);
+static void apply_received(StringInfo s);
+static void delay_queue_put(StringInfo s);
+static bool delay_queue_is_empty(void);
+static long delay_queue_release(void);
+static void apply_received_report(void);
+static void decompress_message(StringInfo s);
+static void receive_batch(StringInfo s);
+static void receive_message(StringInfo s);
+static void lookahead_queue(StringInfo s);
+static void lookahead_apply_one(void);
+static void lookahead_apply_all(void);
+static bool prefetch_change(StringInfo s);
+static void prefetch_note_lookup(BDRRelation *rel, ItemPointer tid);
 static HeapTuple process_queued_drop(HeapTuple cmdtup);
 static void process_queued_ddl_command(HeapTuple cmdtup, bool tx_just_started);
 static bool bdr_performing_work(void);
+static bool group_commit_continue(void);
+static void group_commit_reset(void);
+static void group_commit_flush(void);
 
 static void process_remote_begin(StringInfo s);
 static void process_remote_commit(StringInfo s);
@@ -137,6 +355,8 @@ static void process_remote_insert(StringInfo s);
 static void process_remote_update(StringInfo s);
 static void process_remote_delete(StringInfo s);
 static void process_remote_message(StringInfo s);
+static void process_remote_relation(StringInfo s);
+static void remap_type_oids(StringInfo buf, Oid typid);
 
 static void get_local_tuple_origin(HeapTuple tuple,
 								   TimestampTz *commit_ts,
@@ -215,15 +435,98 @@ action_error_callback(void *arg)
 	}
 }
 
+static void
+forwarded_origins_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS status;
+	BdrForwardedOrigin *entry;
+
+	if (BdrForwardedOrigins == NULL)
+		return;
+
+	/* identifiers are hardly ever created or dropped, just forget them all */
+	hash_seq_init(&status, BdrForwardedOrigins);
+
+	while ((entry = (BdrForwardedOrigin *) hash_seq_search(&status)) != NULL)
+	{
+		if (hash_search(BdrForwardedOrigins, &entry->key,
+						HASH_REMOVE, NULL) == NULL)
+			elog(ERROR, "hash table corrupted");
+	}
+}
+
+/*
+ * Get the local RepNodeId for the node identified by (sysid, timeline,
+ * dboid) that a transaction has been forwarded from.
+ */
+static RepNodeId
+lookup_forwarded_origin(uint64 sysid, TimeLineID timeline, Oid dboid)
+{
+	BdrForwardedOriginKey key;
+	BdrForwardedOrigin *entry;
+	char		remote_ident[256];
+	NameData	replication_name;
+	RepNodeId	node_id;
+
+	if (BdrForwardedOrigins == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(BdrForwardedOriginKey);
+		ctl.entrysize = sizeof(BdrForwardedOrigin);
+		ctl.hash = tag_hash;
+		ctl.hcxt = TopMemoryContext;
+
+		BdrForwardedOrigins = hash_create("BDR forwarded origins", 16, &ctl,
+										  HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+		CacheRegisterSyscacheCallback(REPLIDREMOTE,
+									  forwarded_origins_invalidate,
+									  (Datum) 0);
+	}
+
+	/* outside a transaction nothing else would process invalidations */
+	AcceptInvalidationMessages();
+
+	memset(&key, 0, sizeof(key));
+	key.sysid = sysid;
+	key.timeline = timeline;
+	key.dboid = dboid;
+
+	entry = hash_search(BdrForwardedOrigins, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+		return entry->node_id;
+
+	/* replication_name is currently unused in bdr */
+	NameStr(replication_name)[0] = '\0';
+
+	snprintf(remote_ident, sizeof(remote_ident),
+			BDR_NODE_ID_FORMAT,
+			sysid, timeline, dboid, MyDatabaseId,
+			NameStr(replication_name));
+
+	/* can't look it up in the commit group's transaction */
+	group_commit_flush();
+
+	StartTransactionCommand();
+	node_id = GetReplicationIdentifier(remote_ident, false);
+	CommitTransactionCommand();
+
+	/* the commit may have processed invalidations, so enter it only now */
+	entry = hash_search(BdrForwardedOrigins, &key, HASH_ENTER, NULL);
+	entry->node_id = node_id;
+
+	return node_id;
+}
+
 static void
 process_remote_begin(StringInfo s)
 {
 	XLogRecPtr		origlsn;
 	TimestampTz		committime;
-	TimestampTz		current;
 	TransactionId	remote_xid;
 	char			statbuf[100];
-	int				apply_delay = bdr_apply_config->apply_delay;
 	int				flags = 0;
 	ErrorContextCallback errcallback;
 	struct ActionErrCallbackArg cbarg;
@@ -238,7 +541,9 @@ process_remote_begin(StringInfo s)
 	errcallback.previous = error_context_stack;
 	error_context_stack = &errcallback;
 
-	started_transaction = false;
+	/* keep the local transaction of a commit group */
+	if (group_commit_xacts == 0)
+		started_transaction = false;
 	remote_origin_id = InvalidRepNodeId;
 
 	flags = pq_getmsgint(s, 4);
@@ -265,14 +570,6 @@ process_remote_begin(StringInfo s)
 		remote_origin_lsn = InvalidXLogRecPtr;
 	}
 
-
-	/* setup state for commit and conflict detection */
-	replication_origin_lsn = origlsn;
-	replication_origin_timestamp = committime;
-
-	/* store remote xid for logging and debugging */
-	replication_origin_xid = remote_xid;
-
 	snprintf(statbuf, sizeof(statbuf),
 			"bdr_apply: BEGIN origin(orig_lsn, timestamp): %X/%X, %s",
 			(uint32) (origlsn >> 32), (uint32) origlsn,
@@ -280,18 +577,12 @@ process_remote_begin(StringInfo s)
 
 	pgstat_report_activity(STATE_RUNNING, statbuf);
 
-	if (apply_delay == -1)
-		apply_delay = bdr_default_apply_delay;
-
 	/*
 	 * If we're in catchup mode, see if this transaction is relayed from
 	 * elsewhere and advance the appropriate slot.
 	 */
 	if (flags & BDR_OUTPUT_TRANSACTION_HAS_ORIGIN)
 	{
-		char remote_ident[256];
-		NameData replication_name;
-
 		if (remote_origin_sysid == GetSystemIdentifier()
 			&& remote_origin_timeline_id == ThisTimeLineID
 			&& remote_origin_dboid == MyDatabaseId)
@@ -306,24 +597,27 @@ process_remote_begin(StringInfo s)
 					 errdetail("Received a transaction from the remote node that originated on this node")));
 		}
 
-		/* replication_name is currently unused in bdr */
-		NameStr(replication_name)[0] = '\0';
-
 		/*
 		 * To determine whether the commit was forwarded by the upstream from
 		 * another node, we need to get the local RepNodeId for that node based
 		 * on the (sysid, timelineid, dboid) supplied in catchup mode.
 		 */
-		snprintf(remote_ident, sizeof(remote_ident),
-				BDR_NODE_ID_FORMAT,
-				remote_origin_sysid, remote_origin_timeline_id, remote_origin_dboid, MyDatabaseId,
-				NameStr(replication_name));
-
-		StartTransactionCommand();
-		remote_origin_id = GetReplicationIdentifier(remote_ident, false);
-		CommitTransactionCommand();
+		remote_origin_id = lookup_forwarded_origin(remote_origin_sysid,
+												   remote_origin_timeline_id,
+												   remote_origin_dboid);
 	}
 
+	/*
+	 * Setup state for commit and conflict detection. Only now, the lookup
+	 * above may have had to commit a pending commit group, which has to get
+	 * the origin data of its own last transaction.
+	 */
+	replication_origin_lsn = origlsn;
+	replication_origin_timestamp = committime;
+
+	/* store remote xid for logging and debugging */
+	replication_origin_xid = remote_xid;
+
 	if (bdr_trace_replay)
 	{
 		StringInfoData si;
@@ -334,29 +628,155 @@ process_remote_begin(StringInfo s)
 		cbarg.suppress_output = false;
 	}
 
-	/* don't want the overhead otherwise */
-	if (apply_delay > 0)
-	{
-		current = GetCurrentIntegerTimestamp();
+	if (error_context_stack == &errcallback)
+		error_context_stack = errcallback.previous;
+}
 
-		/* ensure no weirdness due to clock drift */
-		if (current > replication_origin_timestamp)
-		{
-			long		sec;
-			int			usec;
+/*
+ * Can the local transaction stay open for the next remote transaction?
+ *
+ * With bdr.apply_group_commit_xacts > 1 consecutive small remote
+ * transactions are applied in one local transaction, saving a commit and
+ * WAL flush for each. The group is committed once it gets large or old
+ * enough, when it did something that has to be visible right away, or when
+ * there's no more data to apply at the moment, see bdr_apply_work().
+ */
+static bool
+group_commit_continue(void)
+{
+	int			max_xacts = bdr_apply_group_commit_xacts;
+	int			timeout = bdr_apply_group_commit_timeout;
 
-			current = TimestampTzPlusMilliseconds(current,
-												  -apply_delay);
+	/* parallel apply relies on each commit being done when it's reported */
+	if (bdr_apply_parallel_is_worker || bdr_apply_parallel_active())
+		return false;
 
-			TimestampDifference(current, replication_origin_timestamp,
-								&sec, &usec);
-			/* FIXME: deal with overflow? */
-			pg_usleep(usec + (sec * USECS_PER_SEC));
-		}
+	if (group_commit_unsafe)
+		return false;
+
+	if (fast_catchup)
+	{
+		max_xacts = Max(max_xacts, BDR_CATCHUP_GROUP_COMMIT_XACTS);
+		timeout = Max(timeout, BDR_CATCHUP_GROUP_COMMIT_TIMEOUT);
 	}
 
-	if (error_context_stack == &errcallback)
-		error_context_stack = errcallback.previous;
+	if (group_commit_xacts >= max_xacts)
+		return false;
+
+	return !TimestampDifferenceExceeds(group_commit_start,
+									   GetCurrentTimestamp(),
+									   timeout);
+}
+
+/*
+ * Log how fast catchup replay progresses; at the end, or every
+ * BDR_CATCHUP_PROGRESS_INTERVAL.
+ */
+static void
+catchup_report_progress(XLogRecPtr end_lsn, bool done)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	long		secs;
+	int			usecs;
+	double		elapsed;
+
+	if (!done &&
+		!TimestampDifferenceExceeds(catchup_last_progress, now,
+									BDR_CATCHUP_PROGRESS_INTERVAL))
+		return;
+	catchup_last_progress = now;
+
+	TimestampDifference(catchup_start, now, &secs, &usecs);
+	elapsed = secs + usecs / 1000000.0;
+	if (elapsed <= 0)
+		elapsed = 0.001;
+
+	ereport(LOG,
+			(errmsg("bdr catchup %s %X/%X of %X/%X: " UINT64_FORMAT " transactions, %.1f MB of upstream WAL in %.1f s (%.0f transactions/s, %.1f MB/s)",
+					done ? "replayed to" : "at",
+					(uint32) (end_lsn >> 32), (uint32) end_lsn,
+					(uint32) (bdr_apply_worker->replay_stop_lsn >> 32),
+					(uint32) bdr_apply_worker->replay_stop_lsn,
+					catchup_xacts,
+					(end_lsn - catchup_start_lsn) / (1024.0 * 1024.0),
+					elapsed,
+					catchup_xacts / elapsed,
+					(end_lsn - catchup_start_lsn) / (1024.0 * 1024.0) / elapsed)));
+}
+
+static void
+group_commit_reset(void)
+{
+	group_commit_xacts = 0;
+	group_commit_start = 0;
+	group_commit_end_lsn = InvalidXLogRecPtr;
+	group_commit_origin_lsn = InvalidXLogRecPtr;
+	group_commit_origin_timestamp = 0;
+	group_commit_unsafe = false;
+}
+
+/*
+ * Commit the local transaction the remote transactions applied since the
+ * last commit are part of.
+ */
+static void
+group_commit_flush(void)
+{
+	XLogRecPtr	saved_origin_lsn = replication_origin_lsn;
+	TimestampTz saved_origin_timestamp = replication_origin_timestamp;
+
+	if (group_commit_xacts == 0)
+		return;
+
+	Assert(started_transaction);
+
+	/* done with the executor state of the relations we've modified */
+	bdr_apply_relstate_release_all();
+
+	/*
+	 * The commit record and the commit timestamp of all the group's rows
+	 * are those of its last remote transaction. The group may be committed
+	 * after that transaction's state has been cleared, or set up for the
+	 * next one, so put them back for the commit.
+	 */
+	replication_origin_lsn = group_commit_origin_lsn;
+	replication_origin_timestamp = group_commit_origin_timestamp;
+
+	CommitTransactionCommand();
+	started_transaction = false;
+
+	replication_origin_lsn = saved_origin_lsn;
+	replication_origin_timestamp = saved_origin_timestamp;
+
+	/*
+	 * Associate the end of the last remote commit lsn with the local end of
+	 * the commit record. Parallel apply workers leave that to the
+	 * dispatching apply worker, which sends the feedback.
+	 */
+	if (!bdr_apply_parallel_is_worker)
+		bdr_flush_position_add(XactLastCommitEnd, group_commit_end_lsn);
+
+	/*
+	 * Advance the local replication identifier's lsn, so we don't replay
+	 * these commits again.
+	 *
+	 * We always advance the local replication identifier for the origin node,
+	 * even if we're really replaying a commit that's been forwarded from
+	 * another node (per remote_origin_id below). This is necessary to make
+	 * sure we don't replay the same forwarded commit multiple times.
+	 */
+	if (bdr_apply_parallel_is_worker)
+		bdr_apply_parallel_commit_done(group_commit_end_lsn, XactLastCommitEnd);
+	else
+		AdvanceCachedReplicationIdentifier(group_commit_end_lsn,
+										   XactLastCommitEnd);
+
+	/* report stats, only relevant if something was actually written */
+	pgstat_report_stat(false);
+
+	CurrentResourceOwner = bdr_saved_resowner;
+
+	group_commit_reset();
 }
 
 /*
@@ -410,39 +830,45 @@ process_remote_commit(StringInfo s)
 	Assert(commit_lsn == replication_origin_lsn);
 	Assert(committime == replication_origin_timestamp);
 
+	/*
+	 * Parallel apply workers commit in the upstream's commit order, so the
+	 * replication identifier only ever moves forward.
+	 */
+	if (bdr_apply_parallel_is_worker)
+		bdr_apply_parallel_wait_turn();
+
 	if (started_transaction)
 	{
-		BdrFlushPosition *flushpos;
-
-		CommitTransactionCommand();
-
 		/*
-		 * Associate the end of the remote commit lsn with the local end of
-		 * the commit record.
+		 * Commit, unless we can keep the local transaction open for the
+		 * following remote transactions.
 		 */
-		flushpos = (BdrFlushPosition *) palloc(sizeof(BdrFlushPosition));
-		flushpos->local_end = XactLastCommitEnd;
-		flushpos->remote_end = end_lsn;
-
-		dlist_push_tail(&bdr_lsn_association, &flushpos->node);
+		if (group_commit_xacts++ == 0)
+			group_commit_start = GetCurrentTimestamp();
+		group_commit_end_lsn = end_lsn;
+		group_commit_origin_lsn = commit_lsn;
+		group_commit_origin_timestamp = committime;
+
+		if (!group_commit_continue())
+			group_commit_flush();
+	}
+	else
+	{
+		/*
+		 * Nothing to commit; still advance the replication identifier so we
+		 * don't replay this commit again. Queued DDL may have committed a
+		 * pending group already, this includes it.
+		 */
+		group_commit_reset();
 
-		/* report stats, only relevant if something was actually written */
-		pgstat_report_stat(false);
+		if (bdr_apply_parallel_is_worker)
+			bdr_apply_parallel_commit_done(end_lsn, InvalidXLogRecPtr);
+		else
+			AdvanceCachedReplicationIdentifier(end_lsn, XactLastCommitEnd);
 	}
 
 	pgstat_report_activity(STATE_IDLE, NULL);
 
-	/*
-	 * Advance the local replication identifier's lsn, so we don't replay this
-	 * commit again.
-	 *
-	 * We always advance the local replication identifier for the origin node,
-	 * even if we're really replaying a commit that's been forwarded from
-	 * another node (per remote_origin_id below). This is necessary to make
-	 * sure we don't replay the same forwarded commit multiple times.
-	 */
-	AdvanceCachedReplicationIdentifier(end_lsn, XactLastCommitEnd);
-
 	CurrentResourceOwner = bdr_saved_resowner;
 
 	bdr_count_commit();
@@ -453,6 +879,13 @@ process_remote_commit(StringInfo s)
 
 	xact_action_counter = 0;
 
+	if (bdr_apply_worker->replay_stop_lsn != InvalidXLogRecPtr)
+	{
+		catchup_xacts++;
+		catchup_report_progress(end_lsn,
+								bdr_apply_worker->replay_stop_lsn <= end_lsn);
+	}
+
 	/*
 	 * Stop replay if we're doing limited replay and we've replayed up to the
 	 * last record we're supposed to process.
@@ -471,6 +904,8 @@ process_remote_commit(StringInfo s)
 		 */
 		bdr_apply_worker->replay_stop_lsn = InvalidXLogRecPtr;
 
+		group_commit_flush();
+
 		/* flush all writes so the latest position can be reported back to the sender */
 		XLogFlush(GetXLogWriteRecPtr());
 
@@ -482,95 +917,46 @@ process_remote_commit(StringInfo s)
 		error_context_stack = errcallback.previous;
 }
 
-static void
-process_remote_insert(StringInfo s)
+/*
+ * Insert the remote tuple in relstate's newslot, after looking for local
+ * rows it conflicts with in the unique indexes. On a conflict, conflict
+ * handlers and/or last-update-wins decide which version to retain.
+ *
+ * Returns whether there was a conflict. Callers push the active snapshot.
+ */
+static bool
+insert_checked(BDRRelation *rel, BDRApplyRelState *relstate,
+			   BDRTupleData *new_tuple)
 {
-	char		action;
-	EState	   *estate;
-	BDRTupleData new_tuple;
-	TupleTableSlot *newslot;
-	TupleTableSlot *oldslot;
-	BDRRelation	*rel;
-	bool		started_tx;
+	EState	   *estate = relstate->estate;
+	TupleTableSlot *newslot = relstate->newslot;
+	TupleTableSlot *oldslot = relstate->oldslot;
 	ResultRelInfo *relinfo;
 	ItemPointer conflicts;
 	bool		conflict = false;
 	ScanKey	   *index_keys;
 	int			i;
 	ItemPointerData conflicting_tid;
-	ErrorContextCallback errcallback;
-	struct ActionErrCallbackArg cbarg;
 
 	ItemPointerSetInvalid(&conflicting_tid);
 
-	xact_action_counter++;
-	memset(&cbarg, 0, sizeof(struct ActionErrCallbackArg));
-	cbarg.action_name = "INSERT";
-	errcallback.callback = action_error_callback;
-	errcallback.arg = &cbarg;
-	errcallback.previous = error_context_stack;
-	error_context_stack = &errcallback;
-
-	started_tx = bdr_performing_work();
+	/* the search below wouldn't see batched rows */
+	Assert(insert_batch_ntuples == 0);
 
-	Assert(bdr_apply_worker != NULL);
+	/*
+	 * Search for conflicting tuples.
+	 */
+	relinfo = estate->es_result_relation_info;
+	index_keys = palloc0(relinfo->ri_NumIndices * sizeof(ScanKeyData*));
+	conflicts = palloc0(relinfo->ri_NumIndices * sizeof(ItemPointerData));
 
-	rel = read_rel(s, RowExclusiveLock, &cbarg);
+	build_index_scan_keys(rel, estate, index_keys, new_tuple);
 
-	if (bdr_trace_replay)
+	/* do a SnapshotDirty search for conflicting tuples */
+	for (i = 0; i < relinfo->ri_NumIndices; i++)
 	{
-		StringInfoData si;
-		initStringInfo(&si);
-		format_action_description(&si, "INSERT",
-				cbarg.remote_nspname, cbarg.remote_relname, false);
-		cbarg.suppress_output = true;
-		elog(LOG, "TRACE: %s", si.data);
-		cbarg.suppress_output = false;
-	}
-
-	action = pq_getmsgbyte(s);
-	if (action != 'N')
-		elog(ERROR, "expected new tuple but got %d",
-			 action);
-
-	estate = bdr_create_rel_estate(rel->rel);
-	newslot = ExecInitExtraTupleSlot(estate);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(newslot, RelationGetDescr(rel->rel));
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel->rel));
-
-	read_tuple_parts(s, rel, &new_tuple);
-	{
-		HeapTuple tup;
-		tup = heap_form_tuple(RelationGetDescr(rel->rel),
-							  new_tuple.values, new_tuple.isnull);
-		ExecStoreTuple(tup, newslot, InvalidBuffer, true);
-	}
-
-	if (rel->rel->rd_rel->relkind != RELKIND_RELATION)
-		elog(ERROR, "unexpected relkind '%c' rel \"%s\"",
-			 rel->rel->rd_rel->relkind, RelationGetRelationName(rel->rel));
-
-	/* debug output */
-#ifdef VERBOSE_INSERT
-	log_tuple("INSERT:%s", RelationGetDescr(rel->rel), newslot->tts_tuple);
-#endif
-
-	/*
-	 * Search for conflicting tuples.
-	 */
-	ExecOpenIndices(estate->es_result_relation_info);
-	relinfo = estate->es_result_relation_info;
-	index_keys = palloc0(relinfo->ri_NumIndices * sizeof(ScanKeyData*));
-	conflicts = palloc0(relinfo->ri_NumIndices * sizeof(ItemPointerData));
-
-	build_index_scan_keys(estate, index_keys, &new_tuple);
-
-	/* do a SnapshotDirty search for conflicting tuples */
-	for (i = 0; i < relinfo->ri_NumIndices; i++)
-	{
-		IndexInfo  *ii = relinfo->ri_IndexRelationInfo[i];
-		bool found = false;
+		IndexInfo  *ii = relinfo->ri_IndexRelationInfo[i];
+		bool found = false;
 
 		/*
 		 * Only unique indexes are of interest here, and we can't deal with
@@ -620,8 +1006,6 @@ process_remote_insert(StringInfo s)
 		CHECK_FOR_INTERRUPTS();
 	}
 
-	PushActiveSnapshot(GetTransactionSnapshot());
-
 	/*
 	 * If there's a conflict use the version created later, otherwise do a
 	 * plain insert.
@@ -702,9 +1086,95 @@ process_remote_insert(StringInfo s)
 		bdr_count_insert();
 	}
 
-	PopActiveSnapshot();
+	return conflict;
+}
+
+static void
+process_remote_insert(StringInfo s)
+{
+	char		action;
+	BDRApplyRelState *relstate;
+	EState	   *estate;
+	BDRTupleData *new_tuple;
+	TupleTableSlot *newslot;
+	TupleTableSlot *oldslot;
+	BDRRelation	*rel;
+	bool		started_tx;
+	bool		batch;
+	bool		conflict = false;
+	ErrorContextCallback errcallback;
+	struct ActionErrCallbackArg cbarg;
+
+	xact_action_counter++;
+	memset(&cbarg, 0, sizeof(struct ActionErrCallbackArg));
+	cbarg.action_name = "INSERT";
+	errcallback.callback = action_error_callback;
+	errcallback.arg = &cbarg;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
+
+	started_tx = bdr_performing_work();
+
+	Assert(bdr_apply_worker != NULL);
+
+	rel = read_rel(s, RowExclusiveLock, &cbarg);
+
+	if (bdr_trace_replay)
+	{
+		StringInfoData si;
+		initStringInfo(&si);
+		format_action_description(&si, "INSERT",
+				cbarg.remote_nspname, cbarg.remote_relname, false);
+		cbarg.suppress_output = true;
+		elog(LOG, "TRACE: %s", si.data);
+		cbarg.suppress_output = false;
+	}
+
+	action = pq_getmsgbyte(s);
+	if (action != 'N')
+		elog(ERROR, "expected new tuple but got %d",
+			 action);
+
+	relstate = bdr_apply_relstate_get(rel);
+	estate = relstate->estate;
+	newslot = relstate->newslot;
+	oldslot = relstate->oldslot;
+
+	/*
+	 * Batched inserts are only ever for a single relation, and the conflict
+	 * check of an insert that isn't batched wouldn't see them.
+	 */
+	batch = insert_batch_eligible(rel, relstate);
+	if (insert_batch_ntuples > 0 &&
+		(insert_batch_relid != RelationGetRelid(rel->rel) || !batch))
+		insert_batch_flush(rel);
+
+	new_tuple = &rel->decode_new;
+	read_tuple_parts(s, rel, new_tuple);
+	{
+		HeapTuple tup;
+		tup = heap_form_tuple(RelationGetDescr(rel->rel),
+							  new_tuple->values, new_tuple->isnull);
+		ExecStoreTuple(tup, newslot, InvalidBuffer, true);
+	}
+
+	if (rel->rel->rd_rel->relkind != RELKIND_RELATION)
+		elog(ERROR, "unexpected relkind '%c' rel \"%s\"",
+			 rel->rel->rd_rel->relkind, RelationGetRelationName(rel->rel));
+
+	/* debug output */
+#ifdef VERBOSE_INSERT
+	log_tuple("INSERT:%s", RelationGetDescr(rel->rel), newslot->tts_tuple);
+#endif
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	if (batch)
+		insert_batch_add(rel, newslot->tts_tuple);
+	else
+		conflict = insert_checked(rel, relstate, new_tuple);
 
-	ExecCloseIndices(estate->es_result_relation_info);
+	PopActiveSnapshot();
 
 	check_bdr_wakeups(rel);
 
@@ -726,14 +1196,14 @@ process_remote_insert(StringInfo s)
 		/*
 		 * Release transaction bound resources for CONCURRENTLY support.
 		 */
-		MemoryContextSwitchTo(MessageContext);
+		MemoryContextSwitchTo(ApplyChangeContext);
 		ht = heap_copytuple(newslot->tts_tuple);
 
 		LockRelationIdForSession(&lockid, RowExclusiveLock);
 		bdr_heap_close(rel, NoLock);
 
-		ExecResetTupleTable(estate->es_tupleTable, true);
-		FreeExecutorState(estate);
+		/* the DDL may change any relation we've modified so far */
+		bdr_apply_relstate_release_all();
 
 		if (relid == QueuedDDLCommandsRelid)
 		{
@@ -760,9 +1230,10 @@ process_remote_insert(StringInfo s)
 	}
 	else
 	{
+		/* the tuples in the slots don't survive ApplyChangeContext resets */
+		ExecClearTuple(oldslot);
+		ExecClearTuple(newslot);
 		bdr_heap_close(rel, NoLock);
-		ExecResetTupleTable(estate->es_tupleTable, true);
-		FreeExecutorState(estate);
 	}
 
 	CommandCounterIncrement();
@@ -771,185 +1242,735 @@ process_remote_insert(StringInfo s)
 		error_context_stack = errcallback.previous;
 }
 
-static void
-process_remote_update(StringInfo s)
+/*
+ * Can remote INSERTs into the relation be batched?
+ *
+ * Changes to the bdr schema have side effects, see check_bdr_wakeups(), and
+ * conflict handlers might want to look at rows inserted earlier. Batched
+ * rows are checked for conflicts only once they're written, which the
+ * relation's indexes have to allow, see insert_batch_flush().
+ */
+static bool
+insert_batch_eligible(BDRRelation *rel, BDRApplyRelState *relstate)
 {
-	char		action;
-	EState	   *estate;
-	TupleTableSlot *newslot;
-	TupleTableSlot *oldslot;
-	bool		pkey_sent;
-	bool		found_tuple;
-	BDRTupleData old_tuple;
-	BDRTupleData new_tuple;
-	Oid			idxoid;
-	BDRRelation	*rel;
-	Relation	idxrel;
-	ScanKeyData skey[INDEX_MAX_KEYS];
-	HeapTuple	user_tuple = NULL,
-				remote_tuple = NULL;
-	ErrorContextCallback errcallback;
-	struct ActionErrCallbackArg cbarg;
-
-	xact_action_counter++;
-	memset(&cbarg, 0, sizeof(struct ActionErrCallbackArg));
-	cbarg.action_name = "UPDATE";
-	errcallback.callback = action_error_callback;
-	errcallback.arg = &cbarg;
-	errcallback.previous = error_context_stack;
-	error_context_stack = &errcallback;
+	if (!relstate->optimistic_insert)
+		return false;
 
-	bdr_performing_work();
+	if (RelationGetNamespace(rel->rel) == BdrSchemaOid)
+		return false;
 
-	rel = read_rel(s, RowExclusiveLock, &cbarg);
+	bdr_get_conflict_handlers(rel);
 
-	if (bdr_trace_replay)
-	{
-		StringInfoData si;
-		initStringInfo(&si);
-		format_action_description(&si, "UPDATE",
-				cbarg.remote_nspname, cbarg.remote_relname, false);
-		cbarg.suppress_output = true;
-		elog(LOG, "TRACE: %s", si.data);
-		cbarg.suppress_output = false;
-	}
+	return rel->conflict_handlers_len == 0;
+}
 
-	action = pq_getmsgbyte(s);
+static void
+insert_batch_add(BDRRelation *rel, HeapTuple tuple)
+{
+	MemoryContext oldcontext;
 
-	/* old key present, identifying key changed */
-	if (action != 'K' && action != 'N')
-		elog(ERROR, "expected action 'N' or 'K', got %c",
-			 action);
+	if (InsertBatchContext == NULL)
+		InsertBatchContext = AllocSetContextCreate(TopMemoryContext,
+												   "BDR insert batch",
+												   ALLOCSET_DEFAULT_MINSIZE,
+												   ALLOCSET_DEFAULT_INITSIZE,
+												   ALLOCSET_DEFAULT_MAXSIZE);
 
-	estate = bdr_create_rel_estate(rel->rel);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel->rel));
-	newslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(newslot, RelationGetDescr(rel->rel));
+	Assert(insert_batch_ntuples == 0 ||
+		   insert_batch_relid == RelationGetRelid(rel->rel));
 
-	if (action == 'K')
-	{
-		pkey_sent = true;
-		read_tuple_parts(s, rel, &old_tuple);
-		action = pq_getmsgbyte(s);
-	}
-	else
-		pkey_sent = false;
+	/* has to survive ApplyChangeContext resets */
+	oldcontext = MemoryContextSwitchTo(InsertBatchContext);
+	insert_batch_tuples[insert_batch_ntuples++] = heap_copytuple(tuple);
+	MemoryContextSwitchTo(oldcontext);
 
-	/* check for new  tuple */
-	if (action != 'N')
-		elog(ERROR, "expected action 'N', got %c",
-			 action);
+	insert_batch_relid = RelationGetRelid(rel->rel);
+	insert_batch_bytes += tuple->t_len;
 
-	if (rel->rel->rd_rel->relkind != RELKIND_RELATION)
-		elog(ERROR, "unexpected relkind '%c' rel \"%s\"",
-			 rel->rel->rd_rel->relkind, RelationGetRelationName(rel->rel));
+	if (insert_batch_ntuples == BDR_INSERT_BATCH_TUPLES ||
+		insert_batch_bytes >= BDR_INSERT_BATCH_BYTES)
+		insert_batch_flush(rel);
+}
 
-	/* read new tuple */
-	read_tuple_parts(s, rel, &new_tuple);
+/*
+ * Write the batched remote INSERTs, the way COPY does.
+ *
+ * Conflicts are rare, so the rows are written without looking for local
+ * rows they conflict with first; the unique indexes just report whether
+ * there may be one, see UserTableTryInsertOpenIndexes(). That happens in a
+ * subtransaction. If any row may conflict, the subtransaction is rolled back
+ * and the rows are inserted again one by one, in order, looking for
+ * conflicts first. Deleting the rows instead would be decoded, and forwarded
+ * to nodes catching up from this one while they join.
+ *
+ * 'open_rel' is a relation the caller has open, possibly the batch's; it's
+ * used as it is, and left open.
+ */
+static void
+insert_batch_flush(BDRRelation *open_rel)
+{
+	BDRRelation *rel;
+	BDRApplyRelState *relstate;
+	EState	   *estate;
+	TupleTableSlot *slot;
+	int			ntuples = insert_batch_ntuples;
+	bool		optimistic;
+	bool		conflict = false;
+	int			i;
 
-	/* lookup index to build scankey */
-	if (rel->rel->rd_indexvalid == 0)
-		RelationGetIndexList(rel->rel);
-	idxoid = rel->rel->rd_replidindex;
-	if (!OidIsValid(idxoid))
-	{
-		elog(ERROR, "could not find primary key for table with oid %u",
-			 RelationGetRelid(rel->rel));
+	if (ntuples == 0)
 		return;
-	}
 
-	/* open index, so we can build scan key for row */
-	idxrel = index_open(idxoid, RowExclusiveLock);
+	/* resolving a conflict below mustn't flush again */
+	insert_batch_ntuples = 0;
 
-	Assert(idxrel->rd_index->indisunique);
+	/* still locked since the inserts were read */
+	if (open_rel != NULL && open_rel->rel != NULL &&
+		RelationGetRelid(open_rel->rel) == insert_batch_relid)
+		rel = open_rel;
+	else
+		rel = bdr_heap_open(insert_batch_relid, NoLock);
+	relstate = bdr_apply_relstate_get(rel);
+	estate = relstate->estate;
+	slot = relstate->newslot;
 
-	/* Use columns from the new tuple if the key didn't change. */
-	build_index_scan_key(skey, rel->rel, idxrel,
-						 pkey_sent ? &old_tuple : &new_tuple);
+	if (insert_batch_subxacts_lxid != MyProc->lxid)
+	{
+		insert_batch_subxacts = 0;
+		insert_batch_subxacts_lxid = MyProc->lxid;
+	}
+	optimistic = insert_batch_subxacts < BDR_INSERT_BATCH_MAX_SUBXACTS;
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
-	/* look for tuple identified by the (old) primary key */
-	found_tuple = find_pkey_tuple(skey, rel, idxrel, oldslot, true,
-						pkey_sent ? LockTupleExclusive : LockTupleNoKeyExclusive);
-
-	if (found_tuple)
+	if (optimistic)
 	{
-		TimestampTz local_ts;
-		RepNodeId	local_node_id;
-		bool		apply_update;
-		bool		log_update;
-		BdrApplyConflict *apply_conflict = NULL; /* Mute compiler */
-		BdrConflictResolution resolution;
-
-		remote_tuple = heap_modify_tuple(oldslot->tts_tuple,
-										 RelationGetDescr(rel->rel),
-										 new_tuple.values,
-										 new_tuple.isnull,
-										 new_tuple.changed);
+		MemoryContext oldcontext = CurrentMemoryContext;
+		ResourceOwner oldowner = CurrentResourceOwner;
 
-		ExecStoreTuple(remote_tuple, newslot, InvalidBuffer, true);
+		insert_batch_subxacts++;
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcontext);
 
-#ifdef VERBOSE_UPDATE
+		if (ntuples > 1)
 		{
-			StringInfoData o;
-			initStringInfo(&o);
-			tuple_to_stringinfo(&o, RelationGetDescr(rel->rel), oldslot->tts_tuple);
-			appendStringInfo(&o, " to");
-			tuple_to_stringinfo(&o, RelationGetDescr(rel->rel), remote_tuple);
-			elog(DEBUG1, "UPDATE:%s", o.data);
-			resetStringInfo(&o);
+			BulkInsertState bistate;
+
+			bistate = GetBulkInsertState();
+			heap_multi_insert(rel->rel, insert_batch_tuples, ntuples,
+							  GetCurrentCommandId(true), 0, bistate);
+			FreeBulkInsertState(bistate);
 		}
-#endif
+		else
+			simple_heap_insert(rel->rel, insert_batch_tuples[0]);
 
-		get_local_tuple_origin(oldslot->tts_tuple, &local_ts, &local_node_id);
+		for (i = 0; i < ntuples && !conflict; i++)
+		{
+			ExecStoreTuple(insert_batch_tuples[i], slot, InvalidBuffer, false);
+			conflict = !UserTableTryInsertOpenIndexes(estate, slot);
+			ResetPerTupleExprContext(estate);
+		}
+		ExecClearTuple(slot);
 
-		/*
-		 * Use conflict triggers and/or last-update-wins to decide which tuple
-		 * to retain.
-		 */
-		check_apply_update(BdrConflictType_UpdateUpdate,
-						   local_node_id, local_ts, rel,
-						   oldslot->tts_tuple, newslot->tts_tuple,
-						   &user_tuple, &apply_update,
-						   &log_update, &resolution);
+		if (conflict)
+			RollbackAndReleaseCurrentSubTransaction();
+		else
+			ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
 
-		/*
-		 * Log conflict to server log
-		 */
-		if (log_update)
+		if (!conflict)
 		{
-			apply_conflict = bdr_make_apply_conflict(
-				BdrConflictType_UpdateUpdate, resolution,
-				replication_origin_xid, rel, oldslot, local_node_id,
-				newslot, NULL /*no error*/);
+			for (i = 0; i < ntuples; i++)
+				bdr_count_insert();
+		}
+	}
 
-			bdr_conflict_log_serverlog(apply_conflict);
+	if (!optimistic || conflict)
+	{
+		BDRTupleData tup;
+		int			natts = RelationGetDescr(rel->rel)->natts;
 
-			bdr_count_update_conflict();
-		}
+		tup.values = palloc(natts * sizeof(Datum));
+		tup.isnull = palloc(natts * sizeof(bool));
+		tup.changed = NULL;
 
-		if (apply_update)
+		for (i = 0; i < ntuples; i++)
 		{
-			/*
-			 * User specified conflict handler provided a new tuple; form it to
-			 * a bdr tuple.
-			 */
-			if (user_tuple)
-			{
-#ifdef VERBOSE_UPDATE
-				log_tuple("USER tuple:%s", RelationGetDescr(rel->rel), user_tuple);
-#endif
-				ExecStoreTuple(user_tuple, newslot, InvalidBuffer, true);
-			}
+			HeapTuple	tuple = insert_batch_tuples[i];
 
-			simple_heap_update(rel->rel, &oldslot->tts_tuple->t_self, newslot->tts_tuple);
-			UserTableUpdateIndexes(estate, newslot);
-			bdr_count_update();
+			heap_deform_tuple(tuple, RelationGetDescr(rel->rel),
+							  tup.values, tup.isnull);
+			ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+
+			insert_checked(rel, relstate, &tup);
+
+			ExecClearTuple(relstate->oldslot);
+			ExecClearTuple(slot);
+			ResetPerTupleExprContext(estate);
+			CommandCounterIncrement();
 		}
 
-		/* Log conflict to table */
+		pfree(tup.values);
+		pfree(tup.isnull);
+	}
+
+	PopActiveSnapshot();
+
+	if (rel != open_rel)
+		bdr_heap_close(rel, NoLock);
+
+	CommandCounterIncrement();
+
+	MemoryContextReset(InsertBatchContext);
+	insert_batch_relid = InvalidOid;
+	insert_batch_bytes = 0;
+}
+
+/*
+ * The apply delay of this connection in milliseconds, 0 if none.
+ */
+static int
+current_apply_delay(void)
+{
+	int			apply_delay = bdr_apply_config->apply_delay;
+
+	if (apply_delay == -1)
+		apply_delay = bdr_default_apply_delay;
+
+	return Max(apply_delay, 0);
+}
+
+/*
+ * Hand a received change to whatever applies it.
+ */
+static void
+apply_received(StringInfo s)
+{
+	if (bdr_apply_parallel_active())
+		bdr_apply_parallel_receive(s);
+	else if (bdr_apply_prefetch_depth > 0)
+		lookahead_queue(s);
+	else
+		bdr_process_remote_action(s);
+}
+
+/*
+ * Hold back a received change until the apply delay has passed.
+ *
+ * Instead of sleeping before applying each transaction, the worker keeps
+ * receiving and queueing, so it keeps answering keepalives and no locks are
+ * held while waiting. Up to work_mem is queued in memory, the rest goes to a
+ * temporary file.
+ */
+static void
+delay_queue_put(StringInfo s)
+{
+	if (delay_queue == NULL)
+	{
+		MemoryContext oldcontext;
+
+		delay_queue = bdr_apply_spool_create("BDR apply delay queue",
+											 &work_mem);
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		initStringInfo(&delay_head);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	bdr_apply_spool_put(delay_queue, s->data + s->cursor, s->len - s->cursor);
+}
+
+static bool
+delay_queue_is_empty(void)
+{
+	return !delay_head_valid &&
+		(delay_queue == NULL || bdr_apply_spool_is_empty(delay_queue));
+}
+
+/*
+ * Apply the queued changes whose delay has passed.
+ *
+ * Returns the number of milliseconds until the next queued transaction is
+ * due, or -1 if the queue is empty.
+ */
+static long
+delay_queue_release(void)
+{
+	int			apply_delay = current_apply_delay();
+
+	if (delay_queue_is_empty())
+		return -1;
+
+	for (;;)
+	{
+		if (!delay_head_valid)
+		{
+			if (!bdr_apply_spool_get(delay_queue, &delay_head))
+				return -1;
+			delay_head_valid = true;
+		}
+
+		/* BEGIN: flags, commit lsn, commit timestamp, ... */
+		if (apply_delay > 0 && delay_head.len >= 1 + 4 + 8 + 8 &&
+			delay_head.data[0] == 'B')
+		{
+			TimestampTz committime;
+			TimestampTz due;
+			TimestampTz current;
+
+			delay_head.cursor = 1 + 4 + 8;
+			committime = pq_getmsgint64(&delay_head);
+			delay_head.cursor = 0;
+
+			due = TimestampTzPlusMilliseconds(committime, apply_delay);
+			current = GetCurrentIntegerTimestamp();
+
+			if (current < due)
+			{
+				long		sec;
+				int			usec;
+
+				TimestampDifference(current, due, &sec, &usec);
+				return sec * 1000L + (usec + 999) / 1000;
+			}
+		}
+
+		delay_head_valid = false;
+		apply_received(&delay_head);
+	}
+}
+
+/*
+ * Publish the size of the changes we hold but haven't applied yet, for
+ * bdr.bdr_apply_received.
+ */
+static void
+apply_received_report(void)
+{
+	Size		queued = lookahead_bytes;
+
+	if (delay_queue != NULL)
+		queued += bdr_apply_spool_memory_used(delay_queue);
+
+	bdr_apply_worker->received_bytes = message_bytes;
+	bdr_apply_worker->queued_bytes = queued;
+	bdr_apply_worker->spooled_bytes = bdr_apply_spool_enabled() ?
+		bdr_apply_spool_memory_used(bdr_apply_receive_spool()) : 0;
+	bdr_apply_worker->received_resets = message_forced_resets;
+}
+
+/*
+ * Queue a received change, applying the oldest queued one once there are
+ * more than bdr.apply_prefetch_depth.
+ */
+static void
+lookahead_queue(StringInfo s)
+{
+	StringInfo	msg;
+
+	msg = makeStringInfo();
+	appendBinaryStringInfo(msg, s->data + s->cursor, s->len - s->cursor);
+	lookahead_msgs = lappend(lookahead_msgs, msg);
+	lookahead_bytes += msg->maxlen;
+
+	if (list_length(lookahead_msgs) > bdr_apply_prefetch_depth)
+		lookahead_apply_one();
+}
+
+/*
+ * Apply the oldest queued change, after prefetching for the ones behind it.
+ */
+static void
+lookahead_apply_one(void)
+{
+	StringInfo	msg;
+
+	msg = (StringInfo) linitial(lookahead_msgs);
+	lookahead_msgs = list_delete_first(lookahead_msgs);
+	if (lookahead_prefetched > 0)
+		lookahead_prefetched--;
+
+	/*
+	 * Looking up the rows needs a transaction, so we only get here once the
+	 * first change of a remote transaction started one. With single-row
+	 * transactions the prefetching happens before applying their commits.
+	 */
+	if (started_transaction && IsTransactionState())
+	{
+		ListCell   *lc;
+		int			i = 0;
+
+		foreach(lc, lookahead_msgs)
+		{
+			if (i++ < lookahead_prefetched)
+				continue;
+
+			if (!prefetch_change((StringInfo) lfirst(lc)))
+				break;
+			lookahead_prefetched++;
+		}
+	}
+
+	bdr_process_remote_action(msg);
+
+	lookahead_bytes -= msg->maxlen;
+	pfree(msg->data);
+	pfree(msg);
+}
+
+/*
+ * Apply all queued changes.
+ */
+static void
+lookahead_apply_all(void)
+{
+	while (lookahead_msgs != NIL && !got_SIGTERM)
+		lookahead_apply_one();
+
+	/* the messages left on SIGTERM are freed with MessageContext */
+	lookahead_msgs = NIL;
+	lookahead_prefetched = 0;
+	lookahead_bytes = 0;
+}
+
+/*
+ * Prefetch the heap blocks a queued UPDATE or DELETE will look at.
+ *
+ * Returns false if later changes can't be prefetched before this one's
+ * been applied, e.g. because it's relation metadata or might execute DDL.
+ */
+static bool
+prefetch_change(StringInfo s)
+{
+	StringInfoData msg;
+	char		action;
+	int			nspnamelen;
+	char	   *nspname;
+	char	   *relname;
+	Oid			relid;
+	BDRRelation *rel;
+	BDRApplyRelState *relstate;
+	BDRTupleData *key;
+	ScanKeyData skey[INDEX_MAX_KEYS];
+	BlockNumber blocks[BDR_PREFETCH_BLOCKS_PER_ROW];
+	int			nblocks;
+	int			i;
+
+	/* don't disturb the queued message */
+	msg = *s;
+	msg.cursor = 0;
+
+	action = pq_getmsgbyte(&msg);
+
+	switch (action)
+	{
+		case 'B':
+		case 'C':
+		case 'I':
+			return true;
+		case 'U':
+		case 'D':
+			break;
+		default:
+			return false;
+	}
+
+	nspnamelen = pq_getmsgint(&msg, 2);
+	if (nspnamelen == 0)
+	{
+		Oid			remote_relid = pq_getmsgint(&msg, 4);
+		BdrRemoteRelation *entry = NULL;
+
+		if (BdrRemoteRelations != NULL)
+			entry = hash_search(BdrRemoteRelations, &remote_relid,
+								HASH_FIND, NULL);
+		if (entry == NULL)
+			return false;
+
+		nspname = pstrdup(NameStr(entry->nspname));
+		relname = pstrdup(NameStr(entry->relname));
+	}
+	else
+	{
+		nspname = pstrdup(pq_getmsgbytes(&msg, nspnamelen));
+		relname = pstrdup(pq_getmsgbytes(&msg, pq_getmsgint(&msg, 2)));
+	}
+
+	/* changes to the bdr schema may execute DDL or take the sequencer lock */
+	if (get_namespace_oid(nspname, true) == BdrSchemaOid)
+		return false;
+
+	/* a relation that doesn't exist yet may be created by an earlier change */
+	relid = RangeVarGetRelidExtended(makeRangeVar(nspname, relname, -1),
+									 RowExclusiveLock, true, false,
+									 NULL, NULL);
+	if (!OidIsValid(relid))
+		return false;
+
+	rel = bdr_heap_open(relid, NoLock);
+
+	if (rel->rel->rd_rel->relkind != RELKIND_RELATION)
+	{
+		bdr_heap_close(rel, NoLock);
+		return false;
+	}
+
+	relstate = bdr_apply_relstate_get(rel);
+
+	/* the old key if it's been sent, the new tuple otherwise */
+	action = pq_getmsgbyte(&msg);
+	if (action == 'K')
+		key = &rel->decode_old;
+	else if (action == 'N')
+		key = &rel->decode_new;
+	else
+		key = NULL;
+
+	if (key != NULL && relstate->replident_index != NULL)
+	{
+		read_tuple_parts(&msg, rel, key);
+
+		if (!build_index_scan_key(skey, rel, relstate->replident_index, key))
+		{
+			nblocks = prefetch_pkey_tuple(skey, rel,
+										  relstate->replident_index,
+										  blocks,
+										  BDR_PREFETCH_BLOCKS_PER_ROW);
+
+			for (i = 0; i < nblocks; i++)
+			{
+				BdrPrefetchedBlock *block;
+
+				block = &prefetched_blocks[prefetched_blocks_next];
+				block->relid = relid;
+				block->blkno = blocks[i];
+				prefetched_blocks_next =
+					(prefetched_blocks_next + 1) % BDR_PREFETCH_BLOCKS;
+				bdr_count_prefetch();
+			}
+		}
+	}
+
+	bdr_heap_close(rel, NoLock);
+
+	return true;
+}
+
+/*
+ * Count a row lookup that found its row in a block prefetched for it.
+ */
+static void
+prefetch_note_lookup(BDRRelation *rel, ItemPointer tid)
+{
+	BlockNumber	blkno = ItemPointerGetBlockNumber(tid);
+	int			i;
+
+	if (bdr_apply_prefetch_depth == 0)
+		return;
+
+	for (i = 0; i < BDR_PREFETCH_BLOCKS; i++)
+	{
+		BdrPrefetchedBlock *block = &prefetched_blocks[i];
+
+		if (block->blkno == blkno &&
+			block->relid == RelationGetRelid(rel->rel))
+		{
+			/* only count each prefetched block once */
+			block->relid = InvalidOid;
+			bdr_count_prefetch_hit();
+			return;
+		}
+	}
+}
+
+static void
+process_remote_update(StringInfo s)
+{
+	char		action;
+	BDRApplyRelState *relstate;
+	EState	   *estate;
+	TupleTableSlot *newslot;
+	TupleTableSlot *oldslot;
+	bool		pkey_sent;
+	bool		found_tuple;
+	BDRTupleData *old_tuple = NULL;
+	BDRTupleData *new_tuple;
+	BDRRelation	*rel;
+	Relation	idxrel;
+	ScanKeyData skey[INDEX_MAX_KEYS];
+	HeapTuple	user_tuple = NULL,
+				remote_tuple = NULL;
+	ErrorContextCallback errcallback;
+	struct ActionErrCallbackArg cbarg;
+
+	xact_action_counter++;
+	memset(&cbarg, 0, sizeof(struct ActionErrCallbackArg));
+	cbarg.action_name = "UPDATE";
+	errcallback.callback = action_error_callback;
+	errcallback.arg = &cbarg;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
+
+	bdr_performing_work();
+
+	rel = read_rel(s, RowExclusiveLock, &cbarg);
+
+	if (bdr_trace_replay)
+	{
+		StringInfoData si;
+		initStringInfo(&si);
+		format_action_description(&si, "UPDATE",
+				cbarg.remote_nspname, cbarg.remote_relname, false);
+		cbarg.suppress_output = true;
+		elog(LOG, "TRACE: %s", si.data);
+		cbarg.suppress_output = false;
+	}
+
+	action = pq_getmsgbyte(s);
+
+	/* old key present, identifying key changed */
+	if (action != 'K' && action != 'N')
+		elog(ERROR, "expected action 'N' or 'K', got %c",
+			 action);
+
+	relstate = bdr_apply_relstate_get(rel);
+	estate = relstate->estate;
+	oldslot = relstate->oldslot;
+	newslot = relstate->newslot;
+
+	if (action == 'K')
+	{
+		pkey_sent = true;
+		old_tuple = &rel->decode_old;
+		read_tuple_parts(s, rel, old_tuple);
+		action = pq_getmsgbyte(s);
+	}
+	else
+		pkey_sent = false;
+
+	/* check for new  tuple */
+	if (action != 'N')
+		elog(ERROR, "expected action 'N', got %c",
+			 action);
+
+	if (rel->rel->rd_rel->relkind != RELKIND_RELATION)
+		elog(ERROR, "unexpected relkind '%c' rel \"%s\"",
+			 rel->rel->rd_rel->relkind, RelationGetRelationName(rel->rel));
+
+	/* read new tuple */
+	new_tuple = &rel->decode_new;
+	read_tuple_parts(s, rel, new_tuple);
+
+	/* the index to build the scankey for, already opened with the rel */
+	idxrel = relstate->replident_index;
+	if (idxrel == NULL)
+	{
+		elog(ERROR, "could not find primary key for table with oid %u",
+			 RelationGetRelid(rel->rel));
+		return;
+	}
+
+	Assert(idxrel->rd_index->indisunique);
+
+	/* Use columns from the new tuple if the key didn't change. */
+	build_index_scan_key(skey, rel, idxrel,
+						 pkey_sent ? old_tuple : new_tuple);
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	/* look for tuple identified by the (old) primary key */
+	found_tuple = find_pkey_tuple(skey, rel, idxrel, oldslot, true,
+						pkey_sent ? LockTupleExclusive : LockTupleNoKeyExclusive);
+
+	if (found_tuple)
+		prefetch_note_lookup(rel, &oldslot->tts_tuple->t_self);
+
+	if (found_tuple)
+	{
+		TimestampTz local_ts;
+		RepNodeId	local_node_id;
+		bool		apply_update;
+		bool		log_update;
+		BdrApplyConflict *apply_conflict = NULL; /* Mute compiler */
+		BdrConflictResolution resolution;
+
+		get_local_tuple_origin(oldslot->tts_tuple, &local_ts, &local_node_id);
+
+		/*
+		 * If the local row was last changed by another node, columns the
+		 * upstream left out as unchanged get the values the upstream had, if
+		 * it sent the complete old tuple, not the local ones. Otherwise the
+		 * row would combine both nodes' changes if the remote one wins, while
+		 * the other node keeps its own row if it does, and they'd diverge.
+		 */
+		if (pkey_sent && local_node_id != replication_origin_id)
+			fill_unchanged_columns(rel, new_tuple, old_tuple);
+
+		remote_tuple = heap_modify_tuple(oldslot->tts_tuple,
+										 RelationGetDescr(rel->rel),
+										 new_tuple->values,
+										 new_tuple->isnull,
+										 new_tuple->changed);
+
+		ExecStoreTuple(remote_tuple, newslot, InvalidBuffer, true);
+
+#ifdef VERBOSE_UPDATE
+		{
+			StringInfoData o;
+			initStringInfo(&o);
+			tuple_to_stringinfo(&o, RelationGetDescr(rel->rel), oldslot->tts_tuple);
+			appendStringInfo(&o, " to");
+			tuple_to_stringinfo(&o, RelationGetDescr(rel->rel), remote_tuple);
+			elog(DEBUG1, "UPDATE:%s", o.data);
+			resetStringInfo(&o);
+		}
+#endif
+
+		/*
+		 * Use conflict triggers and/or last-update-wins to decide which tuple
+		 * to retain.
+		 */
+		check_apply_update(BdrConflictType_UpdateUpdate,
+						   local_node_id, local_ts, rel,
+						   oldslot->tts_tuple, newslot->tts_tuple,
+						   &user_tuple, &apply_update,
+						   &log_update, &resolution);
+
+		/*
+		 * Log conflict to server log
+		 */
+		if (log_update)
+		{
+			apply_conflict = bdr_make_apply_conflict(
+				BdrConflictType_UpdateUpdate, resolution,
+				replication_origin_xid, rel, oldslot, local_node_id,
+				newslot, NULL /*no error*/);
+
+			bdr_conflict_log_serverlog(apply_conflict);
+
+			bdr_count_update_conflict();
+		}
+
+		if (apply_update)
+		{
+			/*
+			 * User specified conflict handler provided a new tuple; form it to
+			 * a bdr tuple.
+			 */
+			if (user_tuple)
+			{
+#ifdef VERBOSE_UPDATE
+				log_tuple("USER tuple:%s", RelationGetDescr(rel->rel), user_tuple);
+#endif
+				ExecStoreTuple(user_tuple, newslot, InvalidBuffer, true);
+			}
+
+			simple_heap_update(rel->rel, &oldslot->tts_tuple->t_self, newslot->tts_tuple);
+			UserTableUpdateOpenIndexes(estate, newslot);
+			bdr_count_update();
+		}
+
+		/* Log conflict to table */
 		if (log_update)
 		{
 			bdr_conflict_log_table(apply_conflict);
@@ -977,9 +1998,16 @@ process_remote_update(StringInfo s)
 		BdrApplyConflict *apply_conflict;
 		BdrConflictResolution resolution;
 
+		/*
+		 * Columns the upstream left out as unchanged have their old values,
+		 * if it sent the complete old tuple.
+		 */
+		if (pkey_sent)
+			fill_unchanged_columns(rel, new_tuple, old_tuple);
+
 		remote_tuple = heap_form_tuple(RelationGetDescr(rel->rel),
-									   new_tuple.values,
-									   new_tuple.isnull);
+									   new_tuple->values,
+									   new_tuple->isnull);
 
 		ExecStoreTuple(remote_tuple, newslot, InvalidBuffer, true);
 
@@ -1027,13 +2055,13 @@ process_remote_update(StringInfo s)
 
 	check_bdr_wakeups(rel);
 
+	/* the tuples in the slots don't survive ApplyChangeContext resets */
+	ExecClearTuple(oldslot);
+	ExecClearTuple(newslot);
+
 	/* release locks upon commit */
-	index_close(idxrel, NoLock);
 	bdr_heap_close(rel, NoLock);
 
-	ExecResetTupleTable(estate->es_tupleTable, true);
-	FreeExecutorState(estate);
-
 	CommandCounterIncrement();
 
 	if (error_context_stack == &errcallback)
@@ -1044,10 +2072,9 @@ static void
 process_remote_delete(StringInfo s)
 {
 	char		action;
-	EState	   *estate;
-	BDRTupleData oldtup;
+	BDRApplyRelState *relstate;
+	BDRTupleData *oldtup;
 	TupleTableSlot *oldslot;
-	Oid			idxoid;
 	BDRRelation	*rel;
 	Relation	idxrel;
 	ScanKeyData skey[INDEX_MAX_KEYS];
@@ -1092,26 +2119,21 @@ process_remote_delete(StringInfo s)
 		return;
 	}
 
-	estate = bdr_create_rel_estate(rel->rel);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel->rel));
+	relstate = bdr_apply_relstate_get(rel);
+	oldslot = relstate->oldslot;
 
-	read_tuple_parts(s, rel, &oldtup);
+	oldtup = &rel->decode_old;
+	read_tuple_parts(s, rel, oldtup);
 
-	/* lookup index to build scankey */
-	if (rel->rel->rd_indexvalid == 0)
-		RelationGetIndexList(rel->rel);
-	idxoid = rel->rel->rd_replidindex;
-	if (!OidIsValid(idxoid))
+	/* the primary key index, already opened with the rel */
+	idxrel = relstate->replident_index;
+	if (idxrel == NULL)
 	{
 		elog(ERROR, "could not find primary key for table with oid %u",
 			 RelationGetRelid(rel->rel));
 		return;
 	}
 
-	/* Now open the primary key index */
-	idxrel = index_open(idxoid, RowExclusiveLock);
-
 	if (rel->rel->rd_rel->relkind != RELKIND_RELATION)
 		elog(ERROR, "unexpected relkind '%c' rel \"%s\"",
 			 rel->rel->rd_rel->relkind, RelationGetRelationName(rel->rel));
@@ -1120,7 +2142,7 @@ process_remote_delete(StringInfo s)
 	{
 		HeapTuple tup;
 		tup = heap_form_tuple(RelationGetDescr(rel->rel),
-							  oldtup.values, oldtup.isnull);
+							  oldtup->values, oldtup->isnull);
 		ExecStoreTuple(tup, oldslot, InvalidBuffer, true);
 	}
 	log_tuple("DELETE old-key:%s", RelationGetDescr(rel->rel), oldslot->tts_tuple);
@@ -1128,13 +2150,14 @@ process_remote_delete(StringInfo s)
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
-	build_index_scan_key(skey, rel->rel, idxrel, &oldtup);
+	build_index_scan_key(skey, rel, idxrel, oldtup);
 
 	/* try to find tuple via a (candidate|primary) key */
 	found_old = find_pkey_tuple(skey, rel, idxrel, oldslot, true, LockTupleExclusive);
 
 	if (found_old)
 	{
+		prefetch_note_lookup(rel, &oldslot->tts_tuple->t_self);
 		simple_heap_delete(rel->rel, &oldslot->tts_tuple->t_self);
 		bdr_count_delete();
 	}
@@ -1168,7 +2191,7 @@ process_remote_delete(StringInfo s)
 
 		/* Since the local tuple is missing, fill slot from the received data. */
 		remote_tuple = heap_form_tuple(RelationGetDescr(rel->rel),
-									   oldtup.values, oldtup.isnull);
+									   oldtup->values, oldtup->isnull);
 		ExecStoreTuple(remote_tuple, oldslot, InvalidBuffer, true);
 
 		/*
@@ -1202,11 +2225,10 @@ process_remote_delete(StringInfo s)
 
 	check_bdr_wakeups(rel);
 
-	index_close(idxrel, NoLock);
-	bdr_heap_close(rel, NoLock);
+	/* the tuple in the slot doesn't survive ApplyChangeContext resets */
+	ExecClearTuple(oldslot);
 
-	ExecResetTupleTable(estate->es_tupleTable, true);
-	FreeExecutorState(estate);
+	bdr_heap_close(rel, NoLock);
 
 	CommandCounterIncrement();
 
@@ -1226,6 +2248,17 @@ get_local_tuple_origin(HeapTuple tuple, TimestampTz *commit_ts, RepNodeId *node_
 	/* refetch tuple, check for old commit ts & origin */
 	xmin = HeapTupleHeaderGetXmin(tuple->t_data);
 
+	/*
+	 * Written by an earlier remote transaction of the same commit group,
+	 * which isn't committed yet.
+	 */
+	if (TransactionIdIsCurrentTransactionId(xmin))
+	{
+		*commit_ts = replication_origin_timestamp;
+		*node_id = replication_origin_id;
+		return;
+	}
+
 	TransactionIdGetCommitTsData(xmin, commit_ts, &node_id_raw);
 	*node_id = node_id_raw;
 }
@@ -1444,6 +2477,15 @@ process_remote_message(StringInfo s)
 	transactional = pq_getmsgbyte(s);
 	lsn = pq_getmsgint64(s);
 
+	/*
+	 * Messages may take part in DDL locking, so nothing can be left waiting
+	 * for commit behind them.
+	 */
+	if (transactional)
+		group_commit_unsafe = true;
+	else
+		group_commit_flush();
+
 	message.len = pq_getmsgint(s, 4);
 	message.data = (char *) pq_getmsgbytes(s, message.len);
 
@@ -2009,14 +3051,17 @@ bdr_performing_work(void)
 {
 	if (started_transaction)
 	{
-		if (CurrentMemoryContext != MessageContext)
-			MemoryContextSwitchTo(MessageContext);
+		if (CurrentMemoryContext != ApplyChangeContext)
+			MemoryContextSwitchTo(ApplyChangeContext);
 		return false;
 	}
 
 	started_transaction = true;
 	StartTransactionCommand();
-	MemoryContextSwitchTo(MessageContext);
+	MemoryContextSwitchTo(ApplyChangeContext);
+
+	if (bdr_apply_parallel_is_worker)
+		bdr_apply_parallel_xact_started();
 	return true;
 }
 
@@ -2029,6 +3074,9 @@ check_bdr_wakeups(BDRRelation *rel)
 	if (schemaoid != BdrSchemaOid)
 		return;
 
+	/* other backends have to see the effects right away */
+	group_commit_unsafe = true;
+
 	/* has the node/connection state been changed on another system? */
 	if (reloid == BdrNodesRelid || reloid == BdrConnectionsRelid)
 		bdr_connections_changed(NULL);
@@ -2039,10 +3087,55 @@ check_bdr_wakeups(BDRRelation *rel)
 		bdr_schedule_eoxact_sequencer_wakeup();
 }
 
+/*
+ * Fetch a by-value datum of length 'len' from the message buffer, which
+ * needn't be suitably aligned for the type.
+ */
+static Datum
+fetch_byval_att(const char *data, int len, char align)
+{
+	/* the common case: it happens to be aligned */
+	if ((uintptr_t) data == att_align_nominal((uintptr_t) data, align))
+		return fetch_att(data, true, len);
+
+	switch (len)
+	{
+		case sizeof(char):
+			return CharGetDatum(*data);
+		case sizeof(int16):
+			{
+				int16		val;
+
+				memcpy(&val, data, sizeof(int16));
+				return Int16GetDatum(val);
+			}
+		case sizeof(int32):
+			{
+				int32		val;
+
+				memcpy(&val, data, sizeof(int32));
+				return Int32GetDatum(val);
+			}
+#if SIZEOF_DATUM == 8
+		case sizeof(Datum):
+			{
+				Datum		val;
+
+				memcpy(&val, data, sizeof(Datum));
+				return val;
+			}
+#endif
+		default:
+			elog(ERROR, "unsupported byval length: %d", len);
+			return 0;			/* keep compiler quiet */
+	}
+}
+
 static void
 read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
 {
 	TupleDesc	desc = RelationGetDescr(rel->rel);
+	BDRAttrDecodeInfo *decode_info;
 	int			i;
 	int			rnatts;
 	char		action;
@@ -2052,19 +3145,18 @@ read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
 	if (action != 'T')
 		elog(ERROR, "expected TUPLE, got %c", action);
 
-	memset(tup->isnull, 1, sizeof(tup->isnull));
-	memset(tup->changed, 1, sizeof(tup->changed));
-
 	rnatts = pq_getmsgint(s, 4);
 
 	if (desc->natts != rnatts)
 		elog(ERROR, "tuple natts mismatch, %u vs %u", desc->natts, rnatts);
 
-	/* FIXME: unaligned data accesses */
+	/* also makes sure the rel's tuple buffers are allocated */
+	decode_info = bdr_relcache_decode_info(rel);
 
 	for (i = 0; i < desc->natts; i++)
 	{
 		Form_pg_attribute att = desc->attrs[i];
+		BDRAttrDecodeInfo *info = &decode_info[i];
 		char		kind = pq_getmsgbyte(s);
 		const char *data;
 		int			len;
@@ -2072,7 +3164,8 @@ read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
 		switch (kind)
 		{
 			case 'n': /* null */
-				/* already marked as null */
+				tup->isnull[i] = true;
+				tup->changed[i] = true;
 				tup->values[i] = 0xdeadbeef;
 				break;
 			case 'u': /* unchanged column */
@@ -2084,35 +3177,72 @@ read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
 
 			case 'b': /* binary format */
 				tup->isnull[i] = false;
+				tup->changed[i] = true;
 				len = pq_getmsgint(s, 4); /* read length */
 
 				data = pq_getmsgbytes(s, len);
 
 				/* and data */
-				if (att->attbyval)
-					tup->values[i] = fetch_att(data, true, len);
+				if (info->typbyval)
+				{
+					if (len != info->typlen)
+						ereport(ERROR,
+								(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+								 errmsg("incorrect binary data format")));
+					tup->values[i] = fetch_byval_att(data, len,
+													 info->typalign);
+				}
 				else
-					tup->values[i] = PointerGetDatum(data);
+				{
+					char	   *copy;
+
+					/*
+					 * The message buffer isn't aligned for the type,
+					 * palloc'd memory is.
+					 */
+					copy = palloc(len);
+					memcpy(copy, data, len);
+					tup->values[i] = PointerGetDatum(copy);
+				}
 				break;
 			case 's': /* send/recv format */
 				{
-					Oid typreceive;
-					Oid typioparam;
 					StringInfoData buf;
 
 					tup->isnull[i] = false;
+					tup->changed[i] = true;
 					len = pq_getmsgint(s, 4); /* read length */
 
-					getTypeBinaryInputInfo(att->atttypid,
-										   &typreceive, &typioparam);
+					if (!info->recv_valid)
+					{
+						Oid typreceive;
+
+						getTypeBinaryInputInfo(att->atttypid, &typreceive,
+											   &info->recv_typioparam);
+						fmgr_info_cxt(typreceive, &info->recv_finfo,
+									  rel->cache_cxt);
+						info->recv_valid = true;
+					}
 
 					/* create StringInfo pointing into the bigger buffer */
 					initStringInfo(&buf);
 					/* and data */
 					buf.data = (char *) pq_getmsgbytes(s, len);
 					buf.len = len;
-					tup->values[i] = OidReceiveFunctionCall(
-						typreceive, &buf, typioparam, att->atttypmod);
+
+					/* embedded upstream type oids have to become ours */
+					if (info->recv_remap)
+					{
+						char	   *copy = palloc(len);
+
+						memcpy(copy, buf.data, len);
+						buf.data = copy;
+						remap_type_oids(&buf, att->atttypid);
+						buf.cursor = 0;
+					}
+					tup->values[i] = ReceiveFunctionCall(
+						&info->recv_finfo, &buf, info->recv_typioparam,
+						info->typmod);
 
 					if (buf.len != buf.cursor)
 						ereport(ERROR,
@@ -2122,17 +3252,26 @@ read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
 				}
 			case 't': /* text format */
 				{
-					Oid typinput;
-					Oid typioparam;
-
 					tup->isnull[i] = false;
+					tup->changed[i] = true;
 					len = pq_getmsgint(s, 4); /* read length */
 
-					getTypeInputInfo(att->atttypid, &typinput, &typioparam);
+					if (!info->input_valid)
+					{
+						Oid typinput;
+
+						getTypeInputInfo(att->atttypid, &typinput,
+										 &info->input_typioparam);
+						fmgr_info_cxt(typinput, &info->input_finfo,
+									  rel->cache_cxt);
+						info->input_valid = true;
+					}
+
 					/* and data */
 					data = (char *) pq_getmsgbytes(s, len);
-					tup->values[i] = OidInputFunctionCall(
-						typinput, (char *) data, typioparam, att->atttypmod);
+					tup->values[i] = InputFunctionCall(
+						&info->input_finfo, (char *) data,
+						info->input_typioparam, info->typmod);
 				}
 				break;
 			default:
@@ -2144,6 +3283,382 @@ read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
 	}
 }
 
+/*
+ * Give the columns of 'new_tuple' the upstream left out as unchanged the
+ * values they have in 'old_tuple', where it has them, and mark them as
+ * changed.
+ */
+static void
+fill_unchanged_columns(BDRRelation *rel, BDRTupleData *new_tuple,
+					   BDRTupleData *old_tuple)
+{
+	int			i;
+
+	for (i = 0; i < RelationGetDescr(rel->rel)->natts; i++)
+	{
+		if (new_tuple->changed[i] || !old_tuple->changed[i])
+			continue;
+		new_tuple->values[i] = old_tuple->values[i];
+		new_tuple->isnull[i] = old_tuple->isnull[i];
+		new_tuple->changed[i] = true;
+	}
+}
+
+static void
+bdr_remote_relations_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	BdrRemoteRelation *entry;
+
+	if (BdrRemoteRelations == NULL)
+		return;
+
+	/*
+	 * The local relation might have been renamed or dropped, so it has to be
+	 * looked up by name again. There usually aren't many entries, so a
+	 * sequential scan is fine.
+	 */
+	hash_seq_init(&status, BdrRemoteRelations);
+
+	while ((entry = (BdrRemoteRelation *) hash_seq_search(&status)) != NULL)
+	{
+		if (relid == InvalidOid || entry->local_relid == relid)
+			entry->local_relid = InvalidOid;
+	}
+}
+
+static void
+bdr_remote_types_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS status;
+	BdrRemoteType *entry;
+
+	if (BdrRemoteTypes == NULL)
+		return;
+
+	/* the local type might have been renamed or dropped */
+	hash_seq_init(&status, BdrRemoteTypes);
+
+	while ((entry = (BdrRemoteType *) hash_seq_search(&status)) != NULL)
+		entry->local_typid = InvalidOid;
+}
+
+/*
+ * Read the names of the upstream types listed in a relation metadata
+ * message.
+ */
+static void
+read_remote_types(StringInfo s)
+{
+	int			ntypes;
+	int			i;
+
+	if (BdrRemoteTypes == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(BdrRemoteType);
+		ctl.hash = tag_hash;
+		ctl.hcxt = TopMemoryContext;
+
+		BdrRemoteTypes = hash_create("BDR remote types", 32, &ctl,
+									 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+		CacheRegisterSyscacheCallback(TYPEOID, bdr_remote_types_invalidate,
+									  (Datum) 0);
+		CacheRegisterSyscacheCallback(NAMESPACEOID, bdr_remote_types_invalidate,
+									  (Datum) 0);
+	}
+
+	ntypes = pq_getmsgint(s, 2);
+
+	for (i = 0; i < ntypes; i++)
+	{
+		Oid			remote_typid;
+		int			nspnamelen;
+		const char *nspname;
+		int			typnamelen;
+		const char *typname;
+		BdrRemoteType *entry;
+
+		remote_typid = pq_getmsgint(s, 4);
+
+		nspnamelen = pq_getmsgint(s, 2);
+		nspname = pq_getmsgbytes(s, nspnamelen);
+
+		typnamelen = pq_getmsgint(s, 2);
+		typname = pq_getmsgbytes(s, typnamelen);
+
+		if (nspnamelen < 1 || nspnamelen > NAMEDATALEN ||
+			nspname[nspnamelen - 1] != '\0' ||
+			typnamelen < 1 || typnamelen > NAMEDATALEN ||
+			typname[typnamelen - 1] != '\0')
+			elog(ERROR, "invalid type name in relation metadata for remote type %u",
+				 remote_typid);
+
+		if (bdr_trace_replay)
+			elog(LOG, "TRACE: TYPE %u is \"%s\".\"%s\"",
+				 remote_typid, nspname, typname);
+
+		entry = hash_search(BdrRemoteTypes, &remote_typid, HASH_ENTER, NULL);
+		strlcpy(NameStr(entry->nspname), nspname, NAMEDATALEN);
+		strlcpy(NameStr(entry->typname), typname, NAMEDATALEN);
+		entry->local_typid = InvalidOid;
+	}
+}
+
+/*
+ * Map the upstream type oid 'remote_typid' to the local type with the same
+ * name. Builtin types have the same oid everywhere.
+ */
+static Oid
+lookup_remote_type(Oid remote_typid)
+{
+	BdrRemoteType *entry = NULL;
+
+	if (remote_typid < FirstNormalObjectId)
+		return remote_typid;
+
+	if (BdrRemoteTypes != NULL)
+		entry = hash_search(BdrRemoteTypes, &remote_typid, HASH_FIND, NULL);
+
+	if (entry == NULL)
+		elog(ERROR, "no type metadata received for remote type %u",
+			 remote_typid);
+
+	if (!OidIsValid(entry->local_typid))
+	{
+		Oid			nspid;
+		Oid			typid;
+
+		nspid = get_namespace_oid(NameStr(entry->nspname), false);
+		typid = GetSysCacheOid2(TYPENAMENSP,
+								CStringGetDatum(NameStr(entry->typname)),
+								ObjectIdGetDatum(nspid));
+		if (!OidIsValid(typid))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("type \"%s\".\"%s\" does not exist",
+							NameStr(entry->nspname), NameStr(entry->typname))));
+		entry->local_typid = typid;
+	}
+
+	return entry->local_typid;
+}
+
+/*
+ * Replace the upstream type oid at the cursor of 'buf' by the local one and
+ * advance past it. Returns the local type.
+ */
+static Oid
+remap_type_oid(StringInfo buf)
+{
+	char	   *p = buf->data + buf->cursor;
+	Oid			typid;
+	uint32		n;
+
+	typid = lookup_remote_type(pq_getmsgint(buf, 4));
+
+	n = htonl(typid);
+	memcpy(p, &n, sizeof(n));
+
+	return typid;
+}
+
+/*
+ * Remap the oids embedded in the value of local type 'typid' in 'buf' (the
+ * element at the cursor if 'typid' is an array or composite).
+ */
+static void
+remap_embedded_oids(StringInfo buf, Oid typid)
+{
+	int			len = pq_getmsgint(buf, 4);
+	StringInfoData elem;
+
+	if (len == -1)
+		return;
+
+	/* bounds checked */
+	elem.data = (char *) pq_getmsgbytes(buf, len);
+	elem.len = len;
+	elem.maxlen = len;
+	elem.cursor = 0;
+
+	remap_type_oids(&elem, typid);
+}
+
+/*
+ * Remap the upstream type oids in the send/recv representation in 'buf' of a
+ * value of local type 'typid', in place, see array_send() and record_send().
+ * Malformed data is left for the receive function to complain about.
+ */
+static void
+remap_type_oids(StringInfo buf, Oid typid)
+{
+	Oid			basetype = getBaseType(typid);
+
+	if (OidIsValid(get_element_type(basetype)))
+	{
+		int			ndim;
+		int			nitems;
+		Oid			elemtype;
+		int			i;
+
+		ndim = pq_getmsgint(buf, 4);
+		pq_getmsgint(buf, 4);		/* has nulls flag */
+		elemtype = remap_type_oid(buf);
+
+		if (ndim < 0 || ndim > MAXDIM)
+			return;
+
+		nitems = ndim > 0 ? 1 : 0;
+		for (i = 0; i < ndim; i++)
+		{
+			nitems *= pq_getmsgint(buf, 4);
+			pq_getmsgint(buf, 4);	/* lower bound */
+		}
+
+		for (i = 0; i < nitems; i++)
+			remap_embedded_oids(buf, elemtype);
+	}
+	else if (get_typtype(basetype) == TYPTYPE_COMPOSITE)
+	{
+		int			ncolumns;
+		int			i;
+
+		ncolumns = pq_getmsgint(buf, 4);
+
+		for (i = 0; i < ncolumns; i++)
+			remap_embedded_oids(buf, remap_type_oid(buf));
+	}
+}
+
+/*
+ * Handle a relation metadata message, telling us the name of the relation
+ * identified by an upstream oid in the following changes.
+ *
+ * If you change this you must also change write_relmeta(...) in
+ * bdr_output.c.
+ */
+static void
+process_remote_relation(StringInfo s)
+{
+	int			flags;
+	Oid			remote_relid;
+	int			nspnamelen;
+	const char *nspname;
+	int			relnamelen;
+	const char *relname;
+	BdrRemoteRelation *entry;
+
+	flags = pq_getmsgint(s, 4);
+
+	if ((flags & ~BDR_OUTPUT_RELATION_HAS_TYPES) != 0)
+		elog(ERROR, "unknown relation flags %i", flags);
+
+	remote_relid = pq_getmsgint(s, 4);
+
+	nspnamelen = pq_getmsgint(s, 2);
+	nspname = pq_getmsgbytes(s, nspnamelen);
+
+	relnamelen = pq_getmsgint(s, 2);
+	relname = pq_getmsgbytes(s, relnamelen);
+
+	if (nspnamelen < 1 || nspnamelen > NAMEDATALEN ||
+		nspname[nspnamelen - 1] != '\0' ||
+		relnamelen < 1 || relnamelen > NAMEDATALEN ||
+		relname[relnamelen - 1] != '\0')
+		elog(ERROR, "invalid relation name in relation metadata for remote relation %u",
+			 remote_relid);
+
+	if (bdr_trace_replay)
+		elog(LOG, "TRACE: RELATION %u is \"%s\".\"%s\"",
+			 remote_relid, nspname, relname);
+
+	if (BdrRemoteRelations == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(BdrRemoteRelation);
+		ctl.hash = tag_hash;
+		ctl.hcxt = TopMemoryContext;
+
+		BdrRemoteRelations = hash_create("BDR remote relations", 128, &ctl,
+										 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(bdr_remote_relations_invalidate,
+									  (Datum) 0);
+	}
+
+	/* the upstream sends the metadata again after its relation changed */
+	entry = hash_search(BdrRemoteRelations, &remote_relid, HASH_ENTER, NULL);
+	strlcpy(NameStr(entry->nspname), nspname, NAMEDATALEN);
+	strlcpy(NameStr(entry->relname), relname, NAMEDATALEN);
+	entry->local_relid = InvalidOid;
+
+	if (flags & BDR_OUTPUT_RELATION_HAS_TYPES)
+		read_remote_types(s);
+}
+
+/*
+ * Map the upstream relation oid 'remote_relid' to the local relation and lock
+ * it in 'mode'.
+ */
+static Oid
+lookup_remote_relation(Oid remote_relid, LOCKMODE mode,
+					   struct ActionErrCallbackArg *cbarg)
+{
+	BdrRemoteRelation *entry = NULL;
+	Oid			relid;
+
+	if (BdrRemoteRelations != NULL)
+		entry = hash_search(BdrRemoteRelations, &remote_relid, HASH_FIND, NULL);
+
+	if (entry == NULL)
+		elog(ERROR, "no relation metadata received for remote relation %u",
+			 remote_relid);
+
+	cbarg->remote_nspname = NameStr(entry->nspname);
+	cbarg->remote_relname = NameStr(entry->relname);
+
+	for (;;)
+	{
+		if (!OidIsValid(entry->local_relid))
+		{
+			RangeVar   *rv;
+
+			rv = makeRangeVar(NameStr(entry->nspname),
+							  NameStr(entry->relname), -1);
+			relid = RangeVarGetRelidExtended(rv, mode, false, false, NULL, NULL);
+			entry->local_relid = relid;
+			return relid;
+		}
+
+		/*
+		 * Locking processes pending invalidations; if they affected the
+		 * relation we have to look it up by name again.
+		 */
+		relid = entry->local_relid;
+		LockRelationOid(relid, mode);
+
+		if (entry->local_relid == relid)
+			return relid;
+
+		UnlockRelationOid(relid, mode);
+	}
+}
+
+/*
+ * Read the identity of the relation a change belongs to, and open it.
+ *
+ * The relation is either identified by schema and relation name, or, if the
+ * schema name length is zero, by the upstream's oid for it. See write_rel in
+ * bdr_output.c.
+ */
 static BDRRelation *
 read_rel(StringInfo s, LOCKMODE mode, struct ActionErrCallbackArg *cbarg)
 {
@@ -2152,17 +3667,25 @@ read_rel(StringInfo s, LOCKMODE mode, struct ActionErrCallbackArg *cbarg)
 	RangeVar*	rv;
 	Oid			relid;
 
-	rv = makeNode(RangeVar);
-
 	nspnamelen = pq_getmsgint(s, 2);
-	rv->schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
-	cbarg->remote_nspname = rv->schemaname;
 
-	relnamelen = pq_getmsgint(s, 2);
-	rv->relname = (char *) pq_getmsgbytes(s, relnamelen);
-	cbarg->remote_relname = rv->relname;
+	if (nspnamelen == 0)
+	{
+		relid = lookup_remote_relation(pq_getmsgint(s, 4), mode, cbarg);
+	}
+	else
+	{
+		rv = makeNode(RangeVar);
+
+		rv->schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
+		cbarg->remote_nspname = rv->schemaname;
+
+		relnamelen = pq_getmsgint(s, 2);
+		rv->relname = (char *) pq_getmsgbytes(s, relnamelen);
+		cbarg->remote_relname = rv->relname;
 
-	relid = RangeVarGetRelidExtended(rv, mode, false, false, NULL, NULL);
+		relid = RangeVarGetRelidExtended(rv, mode, false, false, NULL, NULL);
+	}
 
 	/*
 	 * Acquire sequencer lock if any of the sequencer relations are
@@ -2182,10 +3705,24 @@ read_rel(StringInfo s, LOCKMODE mode, struct ActionErrCallbackArg *cbarg)
  *
  * May set got_SIGTERM to stop processing before next record.
  */
-static void
+void
 bdr_process_remote_action(StringInfo s)
 {
 	char action = pq_getmsgbyte(s);
+	MemoryContext oldcontext;
+
+	if (ApplyChangeContext == NULL)
+		ApplyChangeContext = AllocSetContextCreate(TopMemoryContext,
+												   "BDR apply change",
+												   ALLOCSET_DEFAULT_MINSIZE,
+												   ALLOCSET_DEFAULT_INITSIZE,
+												   ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(ApplyChangeContext);
+
+	/* only a run of inserts can be batched */
+	if (action != 'I' && action != 'R')
+		insert_batch_flush(NULL);
+
 	switch (action)
 	{
 			/* BEGIN */
@@ -2211,9 +3748,16 @@ bdr_process_remote_action(StringInfo s)
 		case 'M':
 			process_remote_message(s);
 			break;
+			/* RELATION metadata */
+		case 'R':
+			process_remote_relation(s);
+			break;
 		default:
 			elog(ERROR, "unknown action of type %c", action);
 	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(ApplyChangeContext);
 }
 
 
@@ -2236,15 +3780,46 @@ bdr_sendint64(int64 i, char *buf)
 	memcpy(&buf[4], &n32, 4);
 }
 
+/*
+ * Remember that the remote commit ending at 'remote_end' has been applied by
+ * a local commit ending at 'local_end'.
+ */
+void
+bdr_flush_position_add(XLogRecPtr local_end, XLogRecPtr remote_end)
+{
+	BdrFlushPosition *pos;
+
+	if (flush_positions_count < BDR_FLUSH_POSITIONS)
+	{
+		pos = &flush_positions[(flush_positions_oldest +
+								flush_positions_count) % BDR_FLUSH_POSITIONS];
+		flush_positions_count++;
+	}
+	else
+	{
+		/*
+		 * Full, merge into the newest entry. Parallel apply workers' commits
+		 * can end locally out of order, so keep the later local end.
+		 */
+		pos = &flush_positions[(flush_positions_oldest +
+								BDR_FLUSH_POSITIONS - 1) % BDR_FLUSH_POSITIONS];
+		if (pos->local_end > local_end)
+			local_end = pos->local_end;
+	}
+
+	pos->local_end = local_end;
+	pos->remote_end = remote_end;
+}
+
 /*
  * Figure out which write/flush positions to report to the walsender process.
  *
  * We can't simply report back the last LSN the walsender sent us because the
  * local transaction might not yet be flushed to disk locally. Instead we
- * build a list that associates local with remote LSNs for every commit. When
- * reporting back the flush position to the sender we iterate that list and
- * check which entries on it are already locally flushed. Those we can report
- * as having been flushed.
+ * associate local with remote LSNs for every commit, see
+ * bdr_flush_position_add(). When reporting back the flush position to the
+ * sender we check which of those are already locally flushed. Those we can
+ * report as having been flushed.
  *
  * Returns true if there's no outstanding transactions that need to be
  * flushed.
@@ -2252,40 +3827,47 @@ bdr_sendint64(int64 i, char *buf)
 static bool
 bdr_get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
 {
-	dlist_mutable_iter iter;
 	XLogRecPtr	local_flush = GetFlushRecPtr();
 
 	*write = InvalidXLogRecPtr;
 	*flush = InvalidXLogRecPtr;
 
-	dlist_foreach_modify(iter, &bdr_lsn_association)
+	while (flush_positions_count > 0)
 	{
-		BdrFlushPosition *pos =
-			dlist_container(BdrFlushPosition, node, iter.cur);
-
-		*write = pos->remote_end;
+		BdrFlushPosition *pos = &flush_positions[flush_positions_oldest];
 
-		if (pos->local_end <= local_flush)
-		{
-			*flush = pos->remote_end;
-			dlist_delete(iter.cur);
-			pfree(pos);
-		}
-		else
+		if (pos->local_end > local_flush)
 		{
-			/*
-			 * Don't want to uselessly iterate over the rest of the list which
-			 * could potentially be long. Instead get the last element and
-			 * grab the write position from there.
-			 */
-			pos = dlist_tail_element(BdrFlushPosition, node,
-									 &bdr_lsn_association);
+			/* the newest entry has the write position */
+			pos = &flush_positions[(flush_positions_oldest +
+									flush_positions_count - 1) %
+								   BDR_FLUSH_POSITIONS];
 			*write = pos->remote_end;
 			return false;
 		}
+
+		*flush = *write = pos->remote_end;
+		flush_positions_oldest = (flush_positions_oldest + 1) %
+			BDR_FLUSH_POSITIONS;
+		flush_positions_count--;
 	}
 
-	return dlist_is_empty(&bdr_lsn_association);
+	/* nor ones held back by the apply delay */
+	if (!delay_queue_is_empty())
+		return false;
+
+	/*
+	 * Transactions handed to parallel apply workers but not committed yet
+	 * aren't on the list, but must not be reported as flushed either.
+	 */
+	if (bdr_apply_parallel_active() && bdr_apply_parallel_has_pending())
+		return false;
+
+	/* neither must remote transactions in a pending commit group */
+	if (group_commit_xacts > 0)
+		return false;
+
+	return true;
 }
 
 /*
@@ -2293,6 +3875,12 @@ bdr_get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
  *
  * 'recvpos' is the latest LSN we've received data to, force is set if we need
  * to send a response to avoid timeouts.
+ *
+ * Once everything received has been flushed, progress is reported right
+ * away. While there's applying left to do, it's reported every
+ * bdr.apply_feedback_interval, or once the flush position advanced by
+ * bdr.apply_feedback_distance, so a worker that's behind doesn't reply after
+ * every few commits.
  */
 static bool
 bdr_send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
@@ -2300,18 +3888,25 @@ bdr_send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 	char		replybuf[1 + 8 + 8 + 8 + 8 + 1];
 	int			len = 0;
 
-	static XLogRecPtr last_recvpos = InvalidXLogRecPtr;
+	/* progress, whether reported yet or not */
 	static XLogRecPtr last_writepos = InvalidXLogRecPtr;
 	static XLogRecPtr last_flushpos = InvalidXLogRecPtr;
 
+	/* what we've told the upstream */
+	static XLogRecPtr sent_writepos = InvalidXLogRecPtr;
+	static XLogRecPtr sent_flushpos = InvalidXLogRecPtr;
+	static TimestampTz sent_time = 0;
+
 	XLogRecPtr writepos;
 	XLogRecPtr flushpos;
+	bool		caught_up;
 
 	/* It's legal to not pass a recvpos */
 	if (recvpos < last_recvpos)
 		recvpos = last_recvpos;
 
-	if (bdr_get_flush_position(&writepos, &flushpos))
+	caught_up = bdr_get_flush_position(&writepos, &flushpos);
+	if (caught_up)
 	{
 		/*
 		 * No outstanding transactions to flush, we can report the latest
@@ -2326,10 +3921,22 @@ bdr_send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 	if (flushpos < last_flushpos)
 		flushpos = last_flushpos;
 
+	/* the flushed commits are gone from flush_positions now */
+	last_recvpos = recvpos;
+	last_writepos = writepos;
+	last_flushpos = flushpos;
+
 	/* if we've already reported everything we're good */
 	if (!force &&
-		writepos == last_writepos &&
-		flushpos == last_flushpos)
+		writepos == sent_writepos &&
+		flushpos == sent_flushpos)
+		return true;
+
+	if (!force && !caught_up && bdr_apply_feedback_interval > 0 &&
+		!TimestampDifferenceExceeds(sent_time, now,
+									bdr_apply_feedback_interval) &&
+		(bdr_apply_feedback_distance == 0 ||
+		 flushpos - sent_flushpos < (uint64) bdr_apply_feedback_distance * 1024))
 		return true;
 
 	replybuf[len] = 'r';
@@ -2362,12 +3969,11 @@ bdr_send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 		return false;
 	}
 
-	if (recvpos > last_recvpos)
-		last_recvpos = recvpos;
-	if (writepos > last_writepos)
-		last_writepos = writepos;
-	if (flushpos > last_flushpos)
-		last_flushpos = flushpos;
+	bdr_count_feedback();
+
+	sent_writepos = writepos;
+	sent_flushpos = flushpos;
+	sent_time = now;
 
 	return true;
 }
@@ -2484,6 +4090,17 @@ bdr_apply_reload_config()
 	}
 }
 
+/*
+ * Set up the apply state of a parallel apply worker for the connection
+ * 'apply' is the shmem slot of.
+ */
+void
+bdr_apply_attach_worker(BdrApplyWorker *apply)
+{
+	bdr_apply_worker = apply;
+	bdr_apply_reload_config();
+}
+
 /*
  * The actual main loop of a BDR apply worker.
  */
@@ -2493,14 +4110,17 @@ bdr_apply_work(PGconn* streamConn)
 	int			fd;
 	char	   *copybuf = NULL;
 	XLogRecPtr	last_received = InvalidXLogRecPtr;
+	long		delay_timeout = -1;
 
 	fd = PQsocket(streamConn);
 
-	MessageContext = AllocSetContextCreate(TopMemoryContext,
-										   "MessageContext",
-										   ALLOCSET_DEFAULT_MINSIZE,
-										   ALLOCSET_DEFAULT_INITSIZE,
-										   ALLOCSET_DEFAULT_MAXSIZE);
+	/* kept when applying is retried in this process */
+	if (MessageContext == NULL)
+		MessageContext = AllocSetContextCreate(TopMemoryContext,
+											   "MessageContext",
+											   ALLOCSET_DEFAULT_MINSIZE,
+											   ALLOCSET_DEFAULT_INITSIZE,
+											   ALLOCSET_DEFAULT_MAXSIZE);
 
 	/* mark as idle, before starting to loop */
 	pgstat_report_activity(STATE_IDLE, NULL);
@@ -2510,17 +4130,28 @@ bdr_apply_work(PGconn* streamConn)
 		/* int		 ret; */
 		int			rc;
 		int			r;
+		long		timeout = 1000L;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
 		 * instead, they may wait on their process latch, which sleeps as
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
+		 *
+		 * Spooled changes are dispatched as parallel apply workers commit,
+		 * which doesn't set our latch, so poll for that.
 		 */
+		if (bdr_apply_parallel_active() && bdr_apply_parallel_has_pending())
+			timeout = 10L;
+
+		/* wake up when the next delayed transaction is due */
+		if (delay_timeout >= 0 && delay_timeout < timeout)
+			timeout = delay_timeout;
+
 		rc = WaitLatchOrSocket(&MyProc->procLatch,
 							   WL_SOCKET_READABLE | WL_LATCH_SET |
 							   WL_TIMEOUT | WL_POSTMASTER_DEATH,
-							   fd, 1000L);
+							   fd, timeout);
 
 		ResetLatch(&MyProc->procLatch);
 
@@ -2533,7 +4164,9 @@ bdr_apply_work(PGconn* streamConn)
 		if (PQstatus(streamConn) == CONNECTION_BAD)
 		{
 			bdr_count_disconnect();
-			elog(ERROR, "connection to other side has died");
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("connection to other side has died")));
 		}
 
 		if (got_SIGHUP)
@@ -2571,12 +4204,16 @@ bdr_apply_work(PGconn* streamConn)
 
 			if (r == -1)
 			{
-				elog(ERROR, "data stream ended");
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("data stream ended")));
 			}
 			else if (r == -2)
 			{
-				elog(ERROR, "could not read COPY data: %s",
-					 PQerrorMessage(streamConn));
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("could not read COPY data: %s",
+								PQerrorMessage(streamConn))));
 			}
 			else if (r < 0)
 				elog(ERROR, "invalid COPY status %d", r);
@@ -2592,10 +4229,11 @@ bdr_apply_work(PGconn* streamConn)
 
 				MemoryContextSwitchTo(MessageContext);
 
-				initStringInfo(&s);
+				/* the data belongs to libpq */
 				s.data = copybuf;
 				s.len = r;
 				s.maxlen = -1;
+				s.cursor = 0;
 
 				c = pq_getmsgbyte(&s);
 
@@ -2614,7 +4252,24 @@ bdr_apply_work(PGconn* streamConn)
 					if (last_received < end_lsn)
 						last_received = end_lsn;
 
-					bdr_process_remote_action(&s);
+					if (s.cursor < s.len && s.data[s.cursor] == 'Z')
+						decompress_message(&s);
+
+					if (s.cursor < s.len && s.data[s.cursor] == 'X')
+						receive_batch(&s);
+					else
+						receive_message(&s);
+
+					message_bytes += s.len;
+					if (bdr_apply_received_data_limit > 0 &&
+						message_bytes > (Size) bdr_apply_received_data_limit * 1024L)
+					{
+						lookahead_apply_all();
+						MemoryContextResetAndDeleteChildren(MessageContext);
+						message_bytes = 0;
+						message_forced_resets++;
+						apply_received_report();
+					}
 				}
 				else if (c == 'k')
 				{
@@ -2625,6 +4280,9 @@ bdr_apply_work(PGconn* streamConn)
 					/* timestamp = */ pq_getmsgint64(&s);
 					reply_requested = pq_getmsgbyte(&s);
 
+					/* don't confirm changes that are only queued */
+					lookahead_apply_all();
+
 					bdr_send_feedback(streamConn, endpos,
 									  GetCurrentTimestamp(),
 									  reply_requested);
@@ -2634,6 +4292,28 @@ bdr_apply_work(PGconn* streamConn)
 
 		}
 
+		/* apply what the apply delay doesn't hold back anymore */
+		delay_timeout = delay_queue_release();
+
+		/*
+		 * No more data for now, commit what we've applied. While catching
+		 * up the group stays open until it's large or old enough.
+		 */
+		lookahead_apply_all();
+		if (!fast_catchup || group_commit_xacts == 0 ||
+			!group_commit_continue())
+			group_commit_flush();
+
+		/*
+		 * Pick up the commits of the parallel apply workers, if any, and hand
+		 * them spooled transactions.
+		 */
+		if (bdr_apply_parallel_active())
+		{
+			bdr_apply_parallel_collect();
+			bdr_apply_parallel_pump();
+		}
+
 		/* confirm all writes at once */
 		bdr_send_feedback(streamConn, last_received,
 						  GetCurrentTimestamp(), false);
@@ -2669,10 +4349,384 @@ bdr_apply_work(PGconn* streamConn)
 				bdr_apply_reload_config();
 			}
 		}
+
+		apply_received_report();
+		MemoryContextResetAndDeleteChildren(MessageContext);
+		message_bytes = 0;
+	}
+}
+
+
+/*
+ * Hand a message received from the upstream to the delay queue, or apply it
+ * if it's not to be delayed.
+ */
+static void
+receive_message(StringInfo s)
+{
+	if (current_apply_delay() > 0 || !delay_queue_is_empty())
+		delay_queue_put(s);
+	else
+		apply_received(s);
+}
+
+/*
+ * Receive each message of a batch, see finish_write() in bdr_output.c: 'X',
+ * then for each message its length and the message.
+ */
+static void
+receive_batch(StringInfo s)
+{
+	pq_getmsgbyte(s);			/* 'X' */
+
+	while (s->cursor < s->len)
+	{
+		StringInfoData msg;
+		int			len;
+
+		len = pq_getmsgint(s, 4);
+
+		/* points into the batch, which is kept until we're done with it */
+		msg.data = (char *) pq_getmsgbytes(s, len);
+		msg.len = len;
+		msg.maxlen = -1;
+		msg.cursor = 0;
+
+		receive_message(&msg);
+	}
+}
+
+/*
+ * Replace the compressed message in 's' by the message it contains, in
+ * MessageContext. See write_compressed() in bdr_output.c.
+ */
+static void
+decompress_message(StringInfo s)
+{
+	int			rawlen;
+	int			clen;
+	PGLZ_Header *compressed;
+	char	   *raw;
+
+	pq_getmsgbyte(s);			/* 'Z' */
+	rawlen = pq_getmsgint(s, 4);
+	clen = s->len - s->cursor;
+
+	if (rawlen <= 0 || clen <= 0)
+		elog(ERROR, "invalid compressed message, %d bytes uncompressed, %d compressed",
+			 rawlen, clen);
+
+	/* pglz wants its header in front of the data, and aligned */
+	compressed = palloc(sizeof(PGLZ_Header) + clen);
+	SET_VARSIZE_COMPRESSED(compressed, sizeof(PGLZ_Header) + clen);
+	compressed->rawsize = rawlen;
+	memcpy((char *) compressed + sizeof(PGLZ_Header),
+		   pq_getmsgbytes(s, clen), clen);
+
+	raw = palloc(rawlen + 1);
+	pglz_decompress(compressed, raw);
+	raw[rawlen] = '\0';
+	pfree(compressed);
+
+	bdr_count_compressed(1 + 4 + clen, rawlen);
+
+	s->data = raw;
+	s->len = rawlen;
+	s->maxlen = rawlen + 1;
+	s->cursor = 0;
+}
+
+/*
+ * Forget about everything received but not applied yet, after an error
+ * aborted applying. Streaming restarts after the last applied commit; a
+ * parallel apply worker applies its transaction again.
+ */
+void
+bdr_apply_reset_state(void)
+{
+	StringInfoData discard;
+
+	started_transaction = false;
+	group_commit_reset();
+
+	if (InsertBatchContext != NULL)
+		MemoryContextReset(InsertBatchContext);
+	insert_batch_relid = InvalidOid;
+	insert_batch_ntuples = 0;
+	insert_batch_bytes = 0;
+
+	/* the queued messages live in MessageContext */
+	lookahead_msgs = NIL;
+	lookahead_prefetched = 0;
+	lookahead_bytes = 0;
+	if (MessageContext != NULL)
 		MemoryContextResetAndDeleteChildren(MessageContext);
+	message_bytes = 0;
+	if (ApplyChangeContext != NULL)
+		MemoryContextReset(ApplyChangeContext);
+
+	if (delay_queue != NULL)
+	{
+		initStringInfo(&discard);
+		while (bdr_apply_spool_get(delay_queue, &discard))
+			;
+		pfree(discard.data);
+	}
+	delay_head_valid = false;
+
+	/* don't report what we'll receive again as flushed once caught up */
+	last_recvpos = InvalidXLogRecPtr;
+
+	replication_origin_xid = InvalidTransactionId;
+	replication_origin_lsn = InvalidXLogRecPtr;
+	replication_origin_timestamp = 0;
+	xact_action_counter = 0;
+
+	CurrentResourceOwner = bdr_saved_resowner;
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Start streaming changes on 'streamConn', from after the last commit
+ * we've applied.
+ */
+static void
+bdr_apply_start_streaming(PGconn *streamConn, NameData *slot_name,
+						  RepNodeId replication_identifier)
+{
+	PGresult   *res;
+	StringInfoData query;
+	char	   *sqlstate;
+
+	/*
+	 * Check whether we already replayed something so we don't replay it
+	 * multiple times.
+	 */
+	apply_start_lsn = RemoteCommitFromCachedReplicationIdentifier();
+
+	elog(INFO, "starting up replication from %u at %X/%X",
+		 replication_identifier,
+		 (uint32) (apply_start_lsn >> 32), (uint32) apply_start_lsn);
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (",
+					 NameStr(*slot_name), (uint32) (apply_start_lsn >> 32),
+					 (uint32) apply_start_lsn);
+	appendStringInfo(&query, "pg_version '%u'", PG_VERSION_NUM);
+	appendStringInfo(&query, ", pg_catversion '%u'", CATALOG_VERSION_NO);
+	appendStringInfo(&query, ", bdr_version '%u'", BDR_VERSION_NUM);
+	appendStringInfo(&query, ", bdr_variant '%s'", BDR_VARIANT);
+	appendStringInfo(&query, ", min_bdr_version '%u'", BDR_MIN_REMOTE_VERSION_NUM);
+	appendStringInfo(&query, ", sizeof_int '%zu'", sizeof(int));
+	appendStringInfo(&query, ", sizeof_long '%zu'", sizeof(long));
+	appendStringInfo(&query, ", sizeof_datum '%zu'", sizeof(Datum));
+	appendStringInfo(&query, ", maxalign '%d'", MAXIMUM_ALIGNOF);
+	appendStringInfo(&query, ", float4_byval '%d'", bdr_get_float4byval());
+	appendStringInfo(&query, ", float8_byval '%d'", bdr_get_float8byval());
+	appendStringInfo(&query, ", integer_datetimes '%d'", bdr_get_integer_timestamps());
+	appendStringInfo(&query, ", bigendian '%d'", bdr_get_bigendian());
+	appendStringInfo(&query, ", db_encoding '%s'", GetDatabaseEncodingName());
+	if (bdr_apply_config->replication_sets != NULL &&
+		bdr_apply_config->replication_sets[0] != 0)
+		appendStringInfo(&query, ", replication_sets '%s'",
+						 bdr_apply_config->replication_sets);
+
+	appendStringInfo(&query, ", db_encoding '%s'", GetDatabaseEncodingName());
+	if (bdr_apply_worker->forward_changesets)
+		appendStringInfo(&query, ", forward_changesets 't'");
+	if (bdr_stream_compression)
+		appendStringInfo(&query, ", compression 'pglz'");
+	if (bdr_stream_changed_columns)
+		appendStringInfo(&query, ", changed_columns_only 't'");
+	if (bdr_stream_batch_size > 0)
+		appendStringInfo(&query, ", batch_size '%d'",
+						 bdr_stream_batch_size * 1024);
+
+	appendStringInfoChar(&query, ')');
+
+	elog(DEBUG3, "Sending replication command: %s", query.data);
+
+	res = PQexec(streamConn, query.data);
+
+	sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+
+	if (PQresultStatus(res) != PGRES_COPY_BOTH)
+	{
+		elog(FATAL, "could not send replication command \"%s\": %s\n, sqlstate: %s",
+			 query.data, PQresultErrorMessage(res), sqlstate);
+	}
+	PQclear(res);
+	pfree(query.data);
+}
+
+/*
+ * End streaming on a connection that's still fine, so streaming can be
+ * started again on it. Returns false if that didn't work out in time.
+ */
+static bool
+bdr_apply_stop_streaming(PGconn *streamConn)
+{
+	TimestampTz start = GetCurrentTimestamp();
+	PGresult   *res;
+	char	   *copybuf;
+	bool		copy_done = false;
+	bool		ok = true;
+	int			r;
+
+	if (PQstatus(streamConn) != CONNECTION_OK ||
+		PQputCopyEnd(streamConn, NULL) <= 0 || PQflush(streamConn) != 0)
+		return false;
+
+	/*
+	 * Throw away what the walsender sent before it saw our CopyDone, until
+	 * it ends the stream and the replication command.
+	 */
+	for (;;)
+	{
+		int			rc;
+
+		if (!copy_done)
+		{
+			r = PQgetCopyData(streamConn, &copybuf, 1);
+			if (r > 0)
+			{
+				PQfreemem(copybuf);
+				continue;
+			}
+			else if (r == -1)
+				copy_done = true;
+			else if (r < 0)
+				return false;
+		}
+
+		if (copy_done && !PQisBusy(streamConn))
+			break;
+
+		if (got_SIGTERM ||
+			TimestampDifferenceExceeds(start, GetCurrentTimestamp(),
+									   BDR_APPLY_STOP_STREAMING_TIMEOUT))
+			return false;
+
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   WL_SOCKET_READABLE | WL_LATCH_SET |
+							   WL_TIMEOUT | WL_POSTMASTER_DEATH,
+							   PQsocket(streamConn), 1000L);
+		ResetLatch(&MyProc->procLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (PQconsumeInput(streamConn) == 0)
+			return false;
+	}
+
+	while ((res = PQgetResult(streamConn)) != NULL)
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			ok = false;
+		PQclear(res);
 	}
+
+	return ok && PQstatus(streamConn) == CONNECTION_OK;
 }
 
+/*
+ * Handle an error that aborted applying, deciding whether to retry in this
+ * process instead of exiting and being restarted by the postmaster after
+ * bgw_restart_time.
+ *
+ * Errors due to the connection, serialization failures, deadlocks and lock
+ * or statement timeouts are retried up to bdr.apply_max_retries times in a
+ * row, after 100ms, then increasing delays. Any other error, or any error
+ * with parallel apply workers, whose transactions we'd have to track down,
+ * ends the worker as before; parallel apply workers retry deadlocks
+ * themselves, see bdr_apply_parallel_worker_main(). Called in PG_CATCH();
+ * returns false if the error is to be rethrown.
+ */
+static bool
+bdr_apply_retry(PGconn **streamConn, int *retries)
+{
+	MemoryContext oldcontext;
+	ErrorData  *edata;
+	bool		reconnect;
+	long		delay;
+	int			rc;
+
+	/* made progress since the last retry, start over */
+	if (RemoteCommitFromCachedReplicationIdentifier() > apply_start_lsn)
+		*retries = 0;
+
+	if (got_SIGTERM || bdr_apply_parallel_active() ||
+		*retries >= bdr_apply_max_retries)
+		return false;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	edata = CopyErrorData();
+	MemoryContextSwitchTo(oldcontext);
+
+	switch (edata->sqlerrcode)
+	{
+		case ERRCODE_T_R_SERIALIZATION_FAILURE:
+		case ERRCODE_T_R_DEADLOCK_DETECTED:
+			bdr_count_retry_conflict();
+			reconnect = false;
+			break;
+		case ERRCODE_LOCK_NOT_AVAILABLE:
+		case ERRCODE_QUERY_CANCELED:
+			bdr_count_retry_lock();
+			reconnect = false;
+			break;
+		default:
+			if (ERRCODE_TO_CATEGORY(edata->sqlerrcode) !=
+				ERRCODE_CONNECTION_EXCEPTION)
+			{
+				FreeErrorData(edata);
+				return false;
+			}
+			bdr_count_retry_connection();
+			reconnect = true;
+			break;
+	}
+	FreeErrorData(edata);
+
+	HOLD_INTERRUPTS();
+
+	EmitErrorReport();
+
+	if (IsTransactionState())
+		bdr_count_rollback();
+	AbortOutOfAnyTransaction();
+
+	MemoryContextSwitchTo(TopMemoryContext);
+	FlushErrorState();
+
+	bdr_apply_reset_state();
+
+	RESUME_INTERRUPTS();
+
+	/* reuse the connection unless it's the problem */
+	if (*streamConn != NULL &&
+		(reconnect || !bdr_apply_stop_streaming(*streamConn)))
+	{
+		PQfinish(*streamConn);
+		*streamConn = NULL;
+	}
+
+	delay = Min(BDR_APPLY_RETRY_MIN_DELAY << Min(*retries, 16),
+				BDR_APPLY_RETRY_MAX_DELAY);
+	(*retries)++;
+
+	elog(LOG, "retrying apply in %ld ms (attempt %d of %d)",
+		 delay, *retries, bdr_apply_max_retries);
+
+	rc = WaitLatch(&MyProc->procLatch,
+				   WL_TIMEOUT | WL_POSTMASTER_DEATH, delay);
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+
+	return true;
+}
 
 /*
  * Entry point for a BDR apply worker.
@@ -2683,14 +4737,13 @@ bdr_apply_work(PGconn* streamConn)
 void
 bdr_apply_main(Datum main_arg)
 {
-	PGconn	   *streamConn;
-	PGresult   *res;
+	PGconn	   *volatile streamConn = NULL;
 	StringInfoData query;
-	char	   *sqlstate;
 	RepNodeId	replication_identifier;
-	XLogRecPtr	start_from;
 	NameData	slot_name;
 	char		status;
+	volatile bool started = false;
+	volatile int retries = 0;
 
 	bdr_bgworker_init(DatumGetInt32(main_arg), BDR_WORKER_APPLY);
 
@@ -2763,89 +4816,89 @@ bdr_apply_main(Datum main_arg)
 						 (uint32)(bdr_apply_worker->replay_stop_lsn >> 32),
 						 (uint32)bdr_apply_worker->replay_stop_lsn);
 
-	/* Make the replication connection to the remote end */
-	streamConn = bdr_establish_connection_and_slot(bdr_apply_config->dsn,
-		query.data, &slot_name, &origin_sysid, &origin_timeline,
-		&origin_dboid, &replication_identifier, NULL);
-
-
-	/* initialize stat subsystem, our id won't change further */
-	bdr_count_set_current_node(replication_identifier);
-
-	/*
-	 * tell replication_identifier.c about our identifier so it can cache the
-	 * search in shared memory.
-	 */
-	SetupCachedReplicationIdentifier(replication_identifier);
-
-	/*
-	 * Check whether we already replayed something so we don't replay it
-	 * multiple times.
-	 */
+	for (;;)
+	{
+		PG_TRY();
+		{
+			/* Make the replication connection to the remote end */
+			if (streamConn == NULL)
+				streamConn = bdr_establish_connection_and_slot(bdr_apply_config->dsn,
+					query.data, &slot_name, &origin_sysid, &origin_timeline,
+					&origin_dboid, &replication_identifier, NULL);
 
-	start_from = RemoteCommitFromCachedReplicationIdentifier();
+			if (!started)
+			{
+				/* initialize stat subsystem, our id won't change further */
+				bdr_count_set_current_node(replication_identifier);
 
-	elog(INFO, "starting up replication from %u at %X/%X",
-		 replication_identifier,
-		 (uint32) (start_from >> 32), (uint32) start_from);
+				/*
+				 * tell replication_identifier.c about our identifier so it
+				 * can cache the search in shared memory.
+				 */
+				SetupCachedReplicationIdentifier(replication_identifier);
+			}
 
-	resetStringInfo(&query);
-	appendStringInfo(&query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (",
-					 NameStr(slot_name), (uint32) (start_from >> 32),
-					 (uint32) start_from);
-	appendStringInfo(&query, "pg_version '%u'", PG_VERSION_NUM);
-	appendStringInfo(&query, ", pg_catversion '%u'", CATALOG_VERSION_NO);
-	appendStringInfo(&query, ", bdr_version '%u'", BDR_VERSION_NUM);
-	appendStringInfo(&query, ", bdr_variant '%s'", BDR_VARIANT);
-	appendStringInfo(&query, ", min_bdr_version '%u'", BDR_MIN_REMOTE_VERSION_NUM);
-	appendStringInfo(&query, ", sizeof_int '%zu'", sizeof(int));
-	appendStringInfo(&query, ", sizeof_long '%zu'", sizeof(long));
-	appendStringInfo(&query, ", sizeof_datum '%zu'", sizeof(Datum));
-	appendStringInfo(&query, ", maxalign '%d'", MAXIMUM_ALIGNOF);
-	appendStringInfo(&query, ", float4_byval '%d'", bdr_get_float4byval());
-	appendStringInfo(&query, ", float8_byval '%d'", bdr_get_float8byval());
-	appendStringInfo(&query, ", integer_datetimes '%d'", bdr_get_integer_timestamps());
-	appendStringInfo(&query, ", bigendian '%d'", bdr_get_bigendian());
-	appendStringInfo(&query, ", db_encoding '%s'", GetDatabaseEncodingName());
-	if (bdr_apply_config->replication_sets != NULL &&
-		bdr_apply_config->replication_sets[0] != 0)
-		appendStringInfo(&query, ", replication_sets '%s'",
-						 bdr_apply_config->replication_sets);
+			bdr_apply_start_streaming(streamConn, &slot_name,
+									  replication_identifier);
 
-	appendStringInfo(&query, ", db_encoding '%s'", GetDatabaseEncodingName());
-	if (bdr_apply_worker->forward_changesets)
-		appendStringInfo(&query, ", forward_changesets 't'");
+			if (!started)
+			{
+				replication_origin_id = replication_identifier;
 
-	appendStringInfoChar(&query, ')');
+				if (bdr_apply_worker->replay_stop_lsn != InvalidXLogRecPtr)
+				{
+					catchup_start = catchup_last_progress = GetCurrentTimestamp();
+					catchup_start_lsn = apply_start_lsn;
+
+					if (bdr_apply_worker->fast_catchup)
+					{
+						fast_catchup = true;
+						SetConfigOption("synchronous_commit", "off",
+										PGC_BACKEND, PGC_S_OVERRIDE);
+					}
+				}
 
-	elog(DEBUG3, "Sending replication command: %s", query.data);
+				bdr_conflict_logging_startup();
 
-	res = PQexec(streamConn, query.data);
+				/*
+				 * Apply independent transactions concurrently if configured
+				 * to. Limited replay during catchup stays serial so it stops
+				 * at exactly the requested lsn. Spooled changes are always
+				 * applied by parallel apply workers, so receiving can go on
+				 * while they wait.
+				 */
+				if ((bdr_parallel_apply_workers > 0 || bdr_apply_spool_enabled()) &&
+					bdr_apply_worker->replay_stop_lsn == InvalidXLogRecPtr)
+					bdr_apply_parallel_start(Max(bdr_parallel_apply_workers, 1),
+											 replication_identifier);
 
-	sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+				started = true;
+			}
 
-	if (PQresultStatus(res) != PGRES_COPY_BOTH)
-	{
-		elog(FATAL, "could not send replication command \"%s\": %s\n, sqlstate: %s",
-			 query.data, PQresultErrorMessage(res), sqlstate);
-	}
-	PQclear(res);
+			bdr_apply_work(streamConn);
+		}
+		PG_CATCH();
+		{
+			PGconn	   *conn = streamConn;
+			int			nretries = retries;
 
-	replication_origin_id = replication_identifier;
+			/* can't count anything before we know our node */
+			if (!started || !bdr_apply_retry(&conn, &nretries))
+			{
+				if (started && IsTransactionState())
+					bdr_count_rollback();
+				PG_RE_THROW();
+			}
 
-	bdr_conflict_logging_startup();
+			streamConn = conn;
+			retries = nretries;
+		}
+		PG_END_TRY();
 
-	PG_TRY();
-	{
-		bdr_apply_work(streamConn);
-	}
-	PG_CATCH();
-	{
-		if (IsTransactionState())
-			bdr_count_rollback();
-		PG_RE_THROW();
+		/* bdr_apply_work() only returns when asked to exit */
+		if (got_SIGTERM)
+			break;
 	}
-	PG_END_TRY();
 
 	/*
 	 * never exit gracefully (as that'd unregister the worker) unless
@@ -0,0 +1,1765 @@
+/* -------------------------------------------------------------------------
+ *
+ * bdr_apply_parallel.c
+ *		Apply independent remote transactions concurrently
+ *
+ * With bdr.parallel_apply_workers > 0 the apply worker keeps receiving the
+ * change stream, but instead of replaying it itself it buffers each remote
+ * transaction and hands it over a shm_mq to one of a set of parallel apply
+ * workers. A transaction modifying a row that a not yet committed
+ * transaction also modifies is queued behind it on the same worker; if such
+ * transactions are spread over several workers the apply worker waits until
+ * they committed. Rows are told apart by their replica identity key where
+ * that's possible, see remember_change(), otherwise whole relations are.
+ *
+ * All parallel apply workers commit in the upstream's commit order, so the
+ * replication identifier and the flush position reported to the upstream
+ * never skip over a transaction that isn't committed locally yet. A later
+ * transaction waiting for its turn to commit may hold a lock an earlier one
+ * needs. So once an earlier transaction has waited for a lock for
+ * deadlock_timeout, the later ones give up and roll back. Each worker then
+ * applies its transaction again after the earlier ones committed, see
+ * bdr_apply_parallel_wait_turn().
+ *
+ * Transactions that carry messages (e.g. for the global DDL lock) or modify
+ * tables in the bdr schema (queued DDL, sequences, ...), and transactions
+ * too large to buffer, are applied by the apply worker itself once all
+ * transactions dispatched before them committed.
+ *
+ * Copyright (C) 2012-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		bdr_apply_parallel.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "bdr.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "access/hash.h"
+#include "access/heapam.h"
+#include "access/sysattr.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+
+#include "libpq/pqformat.h"
+
+#include "nodes/bitmapset.h"
+#include "nodes/makefuncs.h"
+
+#include "postmaster/bgworker.h"
+
+#include "replication/replication_identifier.h"
+
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/resowner.h"
+#include "utils/timestamp.h"
+
+/* externs for bdr apply state */
+extern uint64		origin_sysid;
+extern TimeLineID	origin_timeline;
+extern Oid			origin_dboid;
+
+/* changes to relations in this schema are applied by the apply worker */
+#define BDR_APPLY_PARALLEL_SCHEMA		"bdr"
+
+#define BDR_APPLY_PARALLEL_MAGIC		0x42445241
+/* the queue of worker n is stored under key n + 1 */
+#define BDR_APPLY_PARALLEL_KEY_SHARED	0
+
+#define BDR_APPLY_PARALLEL_QUEUE_SIZE	(256 * 1024)
+
+/* Max number of transactions dispatched but not committed yet */
+#define BDR_APPLY_PARALLEL_MAX_INFLIGHT	256
+
+/* Transactions larger than this are applied by the apply worker itself */
+#define BDR_APPLY_PARALLEL_MAX_XACT_SIZE	(8 * 1024 * 1024)
+
+/*
+ * Rows of a relation a transaction may depend on individually; with more
+ * the transaction depends on the whole relation.
+ */
+#define BDR_APPLY_PARALLEL_MAX_ROWS		32
+
+typedef struct BdrApplyParallelCommit
+{
+	XLogRecPtr	remote_end;
+	/* InvalidXLogRecPtr if the transaction didn't write anything */
+	XLogRecPtr	local_end;
+} BdrApplyParallelCommit;
+
+/* Worker applying a dispatched transaction, once it has begun */
+typedef struct BdrApplyParallelRunning
+{
+	uint64		seq;
+	int			worker;
+} BdrApplyParallelRunning;
+
+/*
+ * State shared between an apply worker and its parallel apply workers, at
+ * the start of the dynamic shared memory segment.
+ */
+typedef struct BdrApplyParallelShared
+{
+	slock_t		mutex;
+
+	/* set once anybody detached, nobody can make progress after that */
+	bool		aborted;
+
+	/* number of the next transaction that may commit */
+	uint64		next_commit_seq;
+
+	/* results of the transactions committed, by seq % MAX_INFLIGHT */
+	BdrApplyParallelCommit commits[BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+
+	/* transactions being applied, by seq % MAX_INFLIGHT */
+	BdrApplyParallelRunning running[BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+
+	/* set by parallel apply workers after they started up or committed */
+	Latch		dispatcher_latch;
+
+	/* apply worker state the parallel apply workers have to share */
+	Oid			dboid;
+	int			apply_slot;
+	uint64		origin_sysid;
+	TimeLineID	origin_timeline;
+	Oid			origin_dboid;
+	RepNodeId	replication_identifier;
+
+	int			nworkers;
+	int			nattached;
+	int			nready;
+	/* set once the worker is ready, NULL before */
+	PGPROC	   *worker_procs[FLEXIBLE_ARRAY_MEMBER];
+} BdrApplyParallelShared;
+
+/*
+ * A row a transaction modifies, identified by a hash of its replica identity
+ * key, or the whole relation if 'row' is 0. Hash collisions only cause
+ * unnecessary waits.
+ */
+typedef struct BdrApplyParallelDep
+{
+	uint32		rel;
+	uint32		row;
+} BdrApplyParallelDep;
+
+/*
+ * A transaction dispatched to a parallel apply worker and not yet seen
+ * committed.
+ */
+typedef struct BdrApplyParallelXact
+{
+	int			worker;
+	int			ndeps;
+	BdrApplyParallelDep *deps;
+} BdrApplyParallelXact;
+
+/* Upstream relation announced in a relation metadata message */
+typedef struct BdrApplyParallelRelation
+{
+	Oid			remote_relid;	/* hash key */
+	bool		is_bdr;
+	NameData	nspname;
+	NameData	relname;
+} BdrApplyParallelRelation;
+
+/* How to tell apart the rows of the local relation changes are for */
+typedef struct BdrApplyParallelKeyInfo
+{
+	uint32		rel;			/* hash key, as in BdrApplyParallelDep */
+	NameData	nspname;
+	NameData	relname;
+	Oid			relid;			/* InvalidOid if there's no such relation */
+	bool		by_row;
+	int			natts;
+	int			nkeys;
+	/* zero based, in ascending order */
+	int			keyatts[INDEX_MAX_KEYS];
+} BdrApplyParallelKeyInfo;
+
+/* Set in parallel apply workers */
+bool		bdr_apply_parallel_is_worker = false;
+
+static dsm_segment *parallel_seg = NULL;
+static BdrApplyParallelShared *parallel_shared = NULL;
+
+/* apply worker state */
+static shm_mq_handle **worker_queues = NULL;
+static BackgroundWorkerHandle **worker_handles = NULL;
+static int *worker_inflight = NULL;
+static int	next_worker = 0;
+static uint64 dispatch_seq = 0;
+static uint64 collected_seq = 0;
+static BdrApplyParallelXact inflight[BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+static HTAB *parallel_relations = NULL;
+static HTAB *parallel_keyinfo = NULL;
+
+/* the remote transaction currently being received */
+static MemoryContext XactBufferContext = NULL;
+static List *xact_messages = NIL;
+static Size xact_size = 0;
+static bool xact_open = false;
+static bool xact_barrier = false;
+static bool xact_serial = false;
+static BdrApplyParallelDep *xact_deps = NULL;
+static int	xact_ndeps = 0;
+static int	xact_maxdeps = 0;
+
+/* next spooled message to dispatch, if valid */
+static StringInfoData pump_msg = {NULL, 0, 0, 0};
+static bool pump_msg_valid = false;
+
+/* parallel apply worker state */
+static int	worker_index = -1;
+static uint64 worker_xact_seq = 0;
+static bool worker_xact_committed = false;
+static int	worker_xact_retries = 0;
+/* the messages of the current transaction, to apply it again */
+static MemoryContext WorkerXactContext = NULL;
+static List *worker_xact_messages = NIL;
+
+static void
+bdr_apply_parallel_detach(dsm_segment *seg, Datum arg)
+{
+	BdrApplyParallelShared *shared = parallel_shared;
+	int			i;
+
+	if (shared == NULL)
+		return;
+
+	SpinLockAcquire(&shared->mutex);
+	shared->aborted = true;
+	SpinLockRelease(&shared->mutex);
+
+	/* wake up everyone waiting for us */
+	for (i = 0; i < shared->nworkers; i++)
+	{
+		if (shared->worker_procs[i] != NULL)
+			SetLatch(&shared->worker_procs[i]->procLatch);
+	}
+	SetLatch(&shared->dispatcher_latch);
+
+	parallel_shared = NULL;
+}
+
+static void
+check_parallel_workers(void)
+{
+	bool		aborted;
+	int			i;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	aborted = parallel_shared->aborted;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	for (i = 0; i < parallel_shared->nworkers; i++)
+	{
+		BgwHandleStatus status;
+		pid_t		pid;
+
+		status = GetBackgroundWorkerPid(worker_handles[i], &pid);
+
+		if (status == BGWH_STOPPED || status == BGWH_POSTMASTER_DIED)
+			aborted = true;
+	}
+
+	if (aborted)
+		ereport(ERROR,
+				(errmsg("bdr parallel apply worker exited unexpectedly")));
+}
+
+/*
+ * Wait for a parallel apply worker to start up or commit.
+ */
+static void
+dispatcher_wait(void)
+{
+	int			rc;
+
+	rc = WaitLatch(&parallel_shared->dispatcher_latch,
+				   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				   1000L);
+
+	ResetLatch(&parallel_shared->dispatcher_latch);
+
+	/* emergency bailout if postmaster has died */
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+
+	CHECK_FOR_INTERRUPTS();
+
+	check_parallel_workers();
+}
+
+/*
+ * The replica identity of a relation may have changed, or it may have been
+ * renamed or dropped, so look it up again. There usually aren't many
+ * entries, so a sequential scan is fine.
+ */
+static void
+keyinfo_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	BdrApplyParallelKeyInfo *entry;
+
+	hash_seq_init(&status, parallel_keyinfo);
+
+	while ((entry = (BdrApplyParallelKeyInfo *) hash_seq_search(&status)) != NULL)
+	{
+		/* a missing relation may have been created */
+		if (relid == InvalidOid || entry->relid == relid ||
+			!OidIsValid(entry->relid))
+			hash_search(parallel_keyinfo, &entry->rel, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Start 'nworkers' parallel apply workers and wait till they're ready to
+ * accept transactions.
+ */
+void
+bdr_apply_parallel_start(int nworkers, RepNodeId replication_identifier)
+{
+	shm_toc_estimator e;
+	shm_toc    *toc;
+	Size		shared_size;
+	Size		segsize;
+	BackgroundWorker bgw;
+	BdrApplyParallelShared *shared;
+	MemoryContext oldcontext;
+	HASHCTL		ctl;
+	int			i;
+
+	Assert(!bdr_apply_parallel_is_worker);
+	Assert(parallel_seg == NULL);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	shared_size = offsetof(BdrApplyParallelShared, worker_procs) +
+		sizeof(PGPROC *) * nworkers;
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, shared_size);
+	for (i = 0; i < nworkers; i++)
+		shm_toc_estimate_chunk(&e, BDR_APPLY_PARALLEL_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, nworkers + 1);
+	segsize = shm_toc_estimate(&e);
+
+	parallel_seg = dsm_create(segsize);
+	/* lives as long as this apply worker */
+	dsm_keep_mapping(parallel_seg);
+
+	toc = shm_toc_create(BDR_APPLY_PARALLEL_MAGIC,
+						 dsm_segment_address(parallel_seg), segsize);
+
+	shared = shm_toc_allocate(toc, shared_size);
+	memset(shared, 0, shared_size);
+	SpinLockInit(&shared->mutex);
+	InitSharedLatch(&shared->dispatcher_latch);
+	OwnLatch(&shared->dispatcher_latch);
+	shared->dboid = MyDatabaseId;
+	shared->apply_slot = bdr_worker_slot - BdrWorkerCtl->slots;
+	shared->origin_sysid = origin_sysid;
+	shared->origin_timeline = origin_timeline;
+	shared->origin_dboid = origin_dboid;
+	shared->replication_identifier = replication_identifier;
+	shared->nworkers = nworkers;
+	shm_toc_insert(toc, BDR_APPLY_PARALLEL_KEY_SHARED, shared);
+
+	parallel_shared = shared;
+	on_dsm_detach(parallel_seg, bdr_apply_parallel_detach, (Datum) 0);
+
+	worker_queues = palloc0(sizeof(shm_mq_handle *) * nworkers);
+	worker_handles = palloc0(sizeof(BackgroundWorkerHandle *) * nworkers);
+	worker_inflight = palloc0(sizeof(int) * nworkers);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(BdrApplyParallelRelation);
+	ctl.hash = tag_hash;
+	ctl.hcxt = TopMemoryContext;
+
+	parallel_relations = hash_create("BDR parallel apply relations", 128, &ctl,
+									 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	if (parallel_keyinfo == NULL)
+	{
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint32);
+		ctl.entrysize = sizeof(BdrApplyParallelKeyInfo);
+		ctl.hash = tag_hash;
+		ctl.hcxt = TopMemoryContext;
+
+		parallel_keyinfo = hash_create("BDR parallel apply key info", 128,
+									   &ctl,
+									   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(keyinfo_invalidate, (Datum) 0);
+	}
+
+	XactBufferContext = AllocSetContextCreate(TopMemoryContext,
+											  "BDR parallel apply transaction",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+
+	memset(&bgw, 0, sizeof(bgw));
+	bgw.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	bgw.bgw_main = NULL;
+	strncpy(bgw.bgw_library_name, BDR_LIBRARY_NAME, BGW_MAXLEN);
+	strncpy(bgw.bgw_function_name, "bdr_apply_parallel_worker_main",
+			BGW_MAXLEN);
+	/* the apply worker restarts all of them if one exits */
+	bgw.bgw_restart_time = BGW_NEVER_RESTART;
+	bgw.bgw_notify_pid = MyProcPid;
+	bgw.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(parallel_seg));
+
+	for (i = 0; i < nworkers; i++)
+	{
+		shm_mq	   *mq;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, BDR_APPLY_PARALLEL_QUEUE_SIZE),
+						   BDR_APPLY_PARALLEL_QUEUE_SIZE);
+		shm_toc_insert(toc, i + 1, mq);
+		shm_mq_set_sender(mq, MyProc);
+		worker_queues[i] = shm_mq_attach(mq, parallel_seg, NULL);
+
+		snprintf(bgw.bgw_name, BGW_MAXLEN,
+				 "bdr parallel apply %d of apply worker %d", i, MyProcPid);
+
+		if (!RegisterDynamicBackgroundWorker(&bgw, &worker_handles[i]))
+			ereport(ERROR,
+					(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+					 errmsg("could not register bdr parallel apply worker"),
+					 errhint("Consider increasing max_worker_processes or decreasing bdr.parallel_apply_workers.")));
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (;;)
+	{
+		int			nready;
+
+		SpinLockAcquire(&shared->mutex);
+		nready = shared->nready;
+		SpinLockRelease(&shared->mutex);
+
+		if (nready == nworkers)
+			break;
+
+		dispatcher_wait();
+	}
+
+	elog(DEBUG1, "started %d bdr parallel apply workers", nworkers);
+}
+
+bool
+bdr_apply_parallel_active(void)
+{
+	return parallel_shared != NULL && !bdr_apply_parallel_is_worker;
+}
+
+/*
+ * Forget about the transactions the parallel apply workers committed, and
+ * remember their commit positions for the feedback sent to the upstream.
+ */
+void
+bdr_apply_parallel_collect(void)
+{
+	uint64		committed;
+	bool		aborted;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	committed = parallel_shared->next_commit_seq;
+	aborted = parallel_shared->aborted;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	if (aborted)
+		ereport(ERROR,
+				(errmsg("bdr parallel apply worker exited unexpectedly")));
+
+	while (collected_seq < committed)
+	{
+		int			idx = collected_seq % BDR_APPLY_PARALLEL_MAX_INFLIGHT;
+		BdrApplyParallelXact *xact = &inflight[idx];
+		BdrApplyParallelCommit *commit = &parallel_shared->commits[idx];
+
+		if (commit->local_end != InvalidXLogRecPtr)
+			bdr_flush_position_add(commit->local_end, commit->remote_end);
+
+		worker_inflight[xact->worker]--;
+		if (xact->deps != NULL)
+			pfree(xact->deps);
+		xact->deps = NULL;
+
+		collected_seq++;
+	}
+}
+
+/*
+ * Are all transactions dispatched so far committed?
+ */
+static bool
+bdr_apply_parallel_idle(void)
+{
+	return collected_seq == dispatch_seq;
+}
+
+static void
+wait_for_all_commits(void)
+{
+	for (;;)
+	{
+		bdr_apply_parallel_collect();
+
+		if (bdr_apply_parallel_idle())
+			break;
+
+		dispatcher_wait();
+	}
+}
+
+static void
+send_to_worker(int worker, StringInfo msg)
+{
+	bool		latch_was_set = false;
+
+	for (;;)
+	{
+		shm_mq_result res;
+		int			rc;
+
+		res = shm_mq_send(worker_queues[worker], msg->len, msg->data, true);
+
+		if (res == SHM_MQ_SUCCESS)
+			break;
+		else if (res == SHM_MQ_DETACHED)
+			ereport(ERROR,
+					(errmsg("bdr parallel apply worker exited unexpectedly")));
+
+		/*
+		 * The queue is full. shm_mq uses our process latch to tell us it has
+		 * space again, but that latch is also used to ask us to reload our
+		 * configuration, so don't lose that request.
+		 */
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (rc & WL_LATCH_SET)
+		{
+			ResetLatch(&MyProc->procLatch);
+			latch_was_set = true;
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		check_parallel_workers();
+	}
+
+	if (latch_was_set)
+		SetLatch(&MyProc->procLatch);
+}
+
+/*
+ * Relation metadata has to reach every parallel apply worker before it sees
+ * a change referring to it, so send it to all of them but 'except_worker'.
+ */
+static void
+broadcast_relation(StringInfo msg, int except_worker)
+{
+	int			i;
+
+	for (i = 0; i < parallel_shared->nworkers; i++)
+	{
+		if (i != except_worker)
+			send_to_worker(i, msg);
+	}
+}
+
+static void
+broadcast_buffered_relations(int except_worker)
+{
+	ListCell   *lc;
+
+	foreach(lc, xact_messages)
+	{
+		StringInfo	msg = (StringInfo) lfirst(lc);
+
+		if (msg->data[0] == 'R')
+			broadcast_relation(msg, except_worker);
+	}
+}
+
+/*
+ * Remember the name of the relation announced by a relation metadata
+ * message, and whether it lives in the bdr schema; we need the metadata
+ * ourselves as well, in case we apply a transaction ourselves.
+ */
+static void
+remember_relation(StringInfo s)
+{
+	StringInfoData r = *s;
+	StringInfoData l = *s;
+	Oid			remote_relid;
+	int			nspnamelen;
+	const char *nspname;
+	int			relnamelen;
+	const char *relname;
+	BdrApplyParallelRelation *entry;
+
+	/* validates the names */
+	bdr_process_remote_action(&l);
+
+	pq_getmsgbyte(&r);			/* action */
+	pq_getmsgint(&r, 4);		/* flags */
+	remote_relid = pq_getmsgint(&r, 4);
+	nspnamelen = pq_getmsgint(&r, 2);
+	nspname = pq_getmsgbytes(&r, nspnamelen);
+	relnamelen = pq_getmsgint(&r, 2);
+	relname = pq_getmsgbytes(&r, relnamelen);
+
+	entry = hash_search(parallel_relations, &remote_relid, HASH_ENTER, NULL);
+	entry->is_bdr = nspnamelen == sizeof(BDR_APPLY_PARALLEL_SCHEMA) &&
+		memcmp(nspname, BDR_APPLY_PARALLEL_SCHEMA, nspnamelen) == 0;
+	strlcpy(NameStr(entry->nspname), nspname, NAMEDATALEN);
+	strlcpy(NameStr(entry->relname), relname, NAMEDATALEN);
+}
+
+/*
+ * Make the current transaction depend on 'row' of relation 'rel', or on the
+ * whole relation if 'row' is 0.
+ */
+static void
+xact_add_dep(uint32 rel, uint32 row)
+{
+	int			nrows = 0;
+	int			i;
+
+	for (i = 0; i < xact_ndeps; i++)
+	{
+		BdrApplyParallelDep *dep = &xact_deps[i];
+
+		if (dep->rel != rel)
+			continue;
+		if (dep->row == 0 || dep->row == row)
+			return;
+		nrows++;
+	}
+
+	if (nrows >= BDR_APPLY_PARALLEL_MAX_ROWS)
+		row = 0;
+
+	/* the whole relation covers its rows */
+	if (row == 0 && nrows > 0)
+	{
+		int			j = 0;
+
+		for (i = 0; i < xact_ndeps; i++)
+		{
+			if (xact_deps[i].rel != rel)
+				xact_deps[j++] = xact_deps[i];
+		}
+		xact_ndeps = j;
+	}
+
+	if (xact_ndeps == xact_maxdeps)
+	{
+		xact_maxdeps = Max(xact_maxdeps * 2, 16);
+		if (xact_deps == NULL)
+			xact_deps = MemoryContextAlloc(XactBufferContext,
+										   sizeof(BdrApplyParallelDep) * xact_maxdeps);
+		else
+			xact_deps = repalloc(xact_deps,
+								 sizeof(BdrApplyParallelDep) * xact_maxdeps);
+	}
+	xact_deps[xact_ndeps].rel = rel;
+	xact_deps[xact_ndeps].row = row;
+	xact_ndeps++;
+}
+
+/*
+ * Can values of this type only be equal if their representation on the
+ * wire is? That's what hashing the key columns relies on.
+ */
+static bool
+key_type_hashable(Oid typid)
+{
+	switch (typid)
+	{
+		case BOOLOID:
+		case CHAROID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case NAMEOID:
+		case TEXTOID:
+		case VARCHAROID:
+		case BYTEAOID:
+		case UUIDOID:
+		case DATEOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Look up the replica identity key of the local relation 'entry' names. We
+ * may or may not be inside a transaction, e.g. one the apply worker keeps
+ * open for group commit.
+ */
+static void
+keyinfo_build(BdrApplyParallelKeyInfo *entry)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	bool		started = false;
+	RangeVar   *rv;
+	Oid			relid;
+
+	entry->relid = InvalidOid;
+	entry->by_row = false;
+	entry->natts = 0;
+	entry->nkeys = 0;
+
+	if (!IsTransactionState())
+	{
+		StartTransactionCommand();
+		started = true;
+	}
+
+	rv = makeRangeVar(NameStr(entry->nspname), NameStr(entry->relname), -1);
+	relid = RangeVarGetRelid(rv, AccessShareLock, true);
+
+	/* if there's no such relation applying the change reports that */
+	if (OidIsValid(relid))
+	{
+		Relation	rel = heap_open(relid, NoLock);
+		TupleDesc	desc = RelationGetDescr(rel);
+		Bitmapset  *keyatts;
+		bool		by_row = true;
+		int			attno;
+
+		entry->relid = relid;
+		entry->natts = desc->natts;
+
+		/* also makes sure rd_replidindex is valid */
+		keyatts = RelationGetIndexAttrBitmap(rel,
+											 INDEX_ATTR_BITMAP_IDENTITY_KEY);
+
+		while ((attno = bms_first_member(keyatts)) >= 0)
+		{
+			attno += FirstLowInvalidHeapAttributeNumber;
+
+			if (attno <= 0 || entry->nkeys >= INDEX_MAX_KEYS ||
+				!key_type_hashable(desc->attrs[attno - 1]->atttypid))
+			{
+				by_row = false;
+				break;
+			}
+			entry->keyatts[entry->nkeys++] = attno - 1;
+		}
+		bms_free(keyatts);
+
+		/* REPLICA IDENTITY FULL doesn't have a key to go by */
+		entry->by_row = by_row && OidIsValid(rel->rd_replidindex) &&
+			entry->nkeys > 0;
+
+		heap_close(rel, NoLock);
+	}
+
+	if (started)
+	{
+		CommitTransactionCommand();
+		CurrentResourceOwner = bdr_saved_resowner;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+static BdrApplyParallelKeyInfo *
+keyinfo_lookup(uint32 rel, const char *nspname, const char *relname)
+{
+	BdrApplyParallelKeyInfo *entry;
+	bool		found;
+
+	entry = hash_search(parallel_keyinfo, &rel, HASH_ENTER, &found);
+
+	if (found &&
+		strcmp(NameStr(entry->nspname), nspname) == 0 &&
+		strcmp(NameStr(entry->relname), relname) == 0)
+		return entry;
+
+	strlcpy(NameStr(entry->nspname), nspname, NAMEDATALEN);
+	strlcpy(NameStr(entry->relname), relname, NAMEDATALEN);
+	keyinfo_build(entry);
+
+	return entry;
+}
+
+/*
+ * Hash the replica identity key columns of the tuple at the cursor of 's',
+ * see read_tuple_parts() in bdr_apply.c for the format, and advance past
+ * it. Returns 0 if the key isn't all there.
+ */
+static uint32
+hash_tuple_key(StringInfo s, BdrApplyParallelKeyInfo *keyinfo)
+{
+	uint32		row = 0;
+	int			k = 0;
+	int			i;
+
+	if (pq_getmsgbyte(s) != 'T' ||
+		(int) pq_getmsgint(s, 4) != keyinfo->natts)
+		return 0;
+
+	for (i = 0; i < keyinfo->natts; i++)
+	{
+		bool		is_key = k < keyinfo->nkeys && keyinfo->keyatts[k] == i;
+		char		kind = pq_getmsgbyte(s);
+		const char *data;
+		int			len;
+
+		switch (kind)
+		{
+			case 'n':
+			case 'u':
+				if (is_key)
+					return 0;
+				break;
+			case 'b':
+			case 's':
+			case 't':
+				len = pq_getmsgint(s, 4);
+				data = pq_getmsgbytes(s, len);
+				if (is_key)
+				{
+					row = (row << 1) | (row >> 31);
+					row ^= DatumGetUInt32(hash_any((const unsigned char *) data,
+												   len));
+				}
+				break;
+			default:
+				return 0;
+		}
+
+		if (is_key)
+			k++;
+	}
+
+	/* 0 means the whole relation */
+	return row != 0 ? row : 1;
+}
+
+/*
+ * Note the rows a change modifies in the current transaction's set of
+ * dependencies, see read_rel() in bdr_apply.c for the format of the
+ * relation, and process_remote_insert() and friends for the rest.
+ *
+ * Rows are identified by their replica identity key, like the change is
+ * applied by, but only if the key columns' values are equal exactly if
+ * their representation on the wire is; otherwise, and if the key isn't
+ * there in full, the transaction depends on the whole relation. Other
+ * unique indexes can still make transactions wait for each other's row
+ * locks; if the earlier one ends up waiting, the later one is applied again,
+ * see bdr_apply_parallel_wait_turn().
+ *
+ * The key is looked up once per relation. Changes to it are DDL, which the
+ * apply worker applies itself and so sees the invalidations of.
+ */
+static void
+remember_change(StringInfo s)
+{
+	StringInfoData r = *s;
+	char		action;
+	int			nspnamelen;
+	const char *nspname = NULL;
+	const char *relname = NULL;
+	uint32		rel;
+	bool		is_bdr;
+	BdrApplyParallelKeyInfo *keyinfo = NULL;
+	uint32		row = 0;
+
+	action = pq_getmsgbyte(&r);
+	nspnamelen = pq_getmsgint(&r, 2);
+
+	if (nspnamelen == 0)
+	{
+		Oid			remote_relid = pq_getmsgint(&r, 4);
+		BdrApplyParallelRelation *entry;
+
+		entry = hash_search(parallel_relations, &remote_relid, HASH_FIND, NULL);
+
+		/* let the error for missing metadata be raised by ourselves */
+		is_bdr = entry == NULL || entry->is_bdr;
+		rel = remote_relid;
+
+		if (entry != NULL)
+		{
+			nspname = NameStr(entry->nspname);
+			relname = NameStr(entry->relname);
+		}
+	}
+	else
+	{
+		int			relnamelen;
+
+		nspname = pq_getmsgbytes(&r, nspnamelen);
+		relnamelen = pq_getmsgint(&r, 2);
+		relname = pq_getmsgbytes(&r, relnamelen);
+
+		is_bdr = nspnamelen == sizeof(BDR_APPLY_PARALLEL_SCHEMA) &&
+			memcmp(nspname, BDR_APPLY_PARALLEL_SCHEMA, nspnamelen) == 0;
+
+		rel = DatumGetUInt32(hash_any((const unsigned char *) nspname, nspnamelen)) ^
+			DatumGetUInt32(hash_any((const unsigned char *) relname, relnamelen));
+
+		/* leave invalid names to the error applying the change raises */
+		if (nspnamelen > NAMEDATALEN || nspname[nspnamelen - 1] != '\0' ||
+			relnamelen < 1 || relnamelen > NAMEDATALEN ||
+			relname[relnamelen - 1] != '\0')
+			nspname = relname = NULL;
+	}
+
+	if (is_bdr)
+	{
+		/* applied by ourselves, no need to look further */
+		xact_barrier = true;
+		return;
+	}
+
+	if (nspname != NULL)
+		keyinfo = keyinfo_lookup(rel, nspname, relname);
+
+	if (keyinfo == NULL || !keyinfo->by_row)
+	{
+		xact_add_dep(rel, 0);
+		return;
+	}
+
+	switch (action)
+	{
+		case 'I':
+			if (pq_getmsgbyte(&r) == 'N')
+				row = hash_tuple_key(&r, keyinfo);
+			break;
+		case 'U':
+			action = pq_getmsgbyte(&r);
+			if (action == 'K')
+			{
+				/* the key changed, the old row is modified as well */
+				row = hash_tuple_key(&r, keyinfo);
+				if (row == 0)
+					break;
+				xact_add_dep(rel, row);
+				action = pq_getmsgbyte(&r);
+			}
+			row = action == 'N' ? hash_tuple_key(&r, keyinfo) : 0;
+			break;
+		case 'D':
+			/* without a key ('E') it's the whole relation */
+			if (pq_getmsgbyte(&r) == 'K')
+				row = hash_tuple_key(&r, keyinfo);
+			break;
+	}
+
+	xact_add_dep(rel, row);
+}
+
+static void
+buffer_message(StringInfo s)
+{
+	MemoryContext oldcontext;
+	StringInfo	msg;
+
+	oldcontext = MemoryContextSwitchTo(XactBufferContext);
+	msg = makeStringInfo();
+	appendBinaryStringInfo(msg, s->data + s->cursor, s->len - s->cursor);
+	xact_messages = lappend(xact_messages, msg);
+	MemoryContextSwitchTo(oldcontext);
+
+	xact_size += msg->len;
+}
+
+static void
+reset_xact(void)
+{
+	MemoryContextReset(XactBufferContext);
+	xact_messages = NIL;
+	xact_size = 0;
+	xact_open = false;
+	xact_barrier = false;
+	xact_deps = NULL;
+	xact_ndeps = 0;
+	xact_maxdeps = 0;
+}
+
+/*
+ * Apply the buffered messages ourselves, after all earlier transactions
+ * committed.
+ */
+static void
+apply_buffered(void)
+{
+	ListCell   *lc;
+
+	wait_for_all_commits();
+
+	broadcast_buffered_relations(-1);
+
+	foreach(lc, xact_messages)
+	{
+		StringInfo	msg = (StringInfo) lfirst(lc);
+
+		msg->cursor = 0;
+		bdr_process_remote_action(msg);
+	}
+}
+
+static bool
+xact_conflicts_with(BdrApplyParallelXact *xact)
+{
+	int			i;
+	int			j;
+
+	for (i = 0; i < xact->ndeps; i++)
+	{
+		BdrApplyParallelDep *a = &xact->deps[i];
+
+		for (j = 0; j < xact_ndeps; j++)
+		{
+			BdrApplyParallelDep *b = &xact_deps[j];
+
+			if (a->rel == b->rel &&
+				(a->row == 0 || b->row == 0 || a->row == b->row))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Can the buffered transaction be dispatched without waiting for commits?
+ *
+ * If so, *target is set to the worker it has to go to, or -1 if it doesn't
+ * depend on any transaction in progress.
+ */
+static bool
+xact_dispatchable(int *target)
+{
+	uint64		seq;
+
+	bdr_apply_parallel_collect();
+
+	*target = -1;
+
+	if (dispatch_seq - collected_seq >= BDR_APPLY_PARALLEL_MAX_INFLIGHT)
+		return false;
+
+	for (seq = collected_seq; seq < dispatch_seq; seq++)
+	{
+		BdrApplyParallelXact *xact;
+
+		xact = &inflight[seq % BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+
+		if (!xact_conflicts_with(xact))
+			continue;
+
+		if (*target == -1)
+			*target = xact->worker;
+		else if (*target != xact->worker)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Hand the buffered transaction to a parallel apply worker, behind the
+ * transactions it depends on.
+ */
+static void
+dispatch_xact(void)
+{
+	BdrApplyParallelXact *xact;
+	StringInfoData seqmsg;
+	ListCell   *lc;
+	int			target;
+	int			i;
+
+	while (!xact_dispatchable(&target))
+		dispatcher_wait();
+
+	/* independent of everything in progress, use the least busy worker */
+	if (target == -1)
+	{
+		for (i = 0; i < parallel_shared->nworkers; i++)
+		{
+			int			w = (next_worker + i) % parallel_shared->nworkers;
+
+			if (target == -1 || worker_inflight[w] < worker_inflight[target])
+				target = w;
+		}
+		next_worker = (target + 1) % parallel_shared->nworkers;
+	}
+
+	broadcast_buffered_relations(target);
+
+	initStringInfo(&seqmsg);
+	pq_sendbyte(&seqmsg, 'S');
+	pq_sendint64(&seqmsg, dispatch_seq);
+	send_to_worker(target, &seqmsg);
+	pfree(seqmsg.data);
+
+	foreach(lc, xact_messages)
+		send_to_worker(target, (StringInfo) lfirst(lc));
+
+	xact = &inflight[dispatch_seq % BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+	xact->worker = target;
+	xact->ndeps = xact_ndeps;
+	xact->deps = NULL;
+	if (xact_ndeps > 0)
+	{
+		xact->deps = MemoryContextAlloc(TopMemoryContext,
+										sizeof(BdrApplyParallelDep) * xact_ndeps);
+		memcpy(xact->deps, xact_deps, sizeof(BdrApplyParallelDep) * xact_ndeps);
+	}
+
+	worker_inflight[target]++;
+	dispatch_seq++;
+}
+
+/*
+ * Process a message received from the upstream: buffer it as part of the
+ * current transaction and, once that's complete, dispatch it.
+ */
+void
+bdr_apply_parallel_dispatch(StringInfo s)
+{
+	char		action = s->data[s->cursor];
+
+	/* transaction too large to buffer, we're applying it ourselves */
+	if (xact_serial)
+	{
+		if (action == 'R')
+		{
+			StringInfoData msg;
+
+			initStringInfo(&msg);
+			appendBinaryStringInfo(&msg, s->data + s->cursor,
+								   s->len - s->cursor);
+			broadcast_relation(&msg, -1);
+			pfree(msg.data);
+
+			remember_relation(s);
+			return;
+		}
+
+		bdr_process_remote_action(s);
+
+		if (action == 'C')
+			xact_serial = false;
+		return;
+	}
+
+	switch (action)
+	{
+		case 'B':
+			if (xact_open)
+				elog(ERROR, "BEGIN received inside a remote transaction");
+			xact_open = true;
+			break;
+		case 'C':
+			break;
+		case 'I':
+		case 'U':
+		case 'D':
+			remember_change(s);
+			break;
+		case 'R':
+			remember_relation(s);
+			break;
+		case 'M':
+			if (!xact_open)
+			{
+				/* non-transactional message, e.g. for the DDL lock */
+				wait_for_all_commits();
+				bdr_process_remote_action(s);
+				return;
+			}
+			xact_barrier = true;
+			break;
+		default:
+			elog(ERROR, "unknown action of type %c", action);
+	}
+
+	buffer_message(s);
+
+	if (action == 'C')
+	{
+		if (xact_barrier)
+			apply_buffered();
+		else
+			dispatch_xact();
+		reset_xact();
+	}
+	else if (xact_size > BDR_APPLY_PARALLEL_MAX_XACT_SIZE)
+	{
+		apply_buffered();
+		reset_xact();
+		xact_serial = true;
+	}
+}
+
+/*
+ * Process a message received from the upstream, via the spool if that's
+ * enabled or still holds older messages.
+ */
+void
+bdr_apply_parallel_receive(StringInfo s)
+{
+	if (bdr_apply_spool_enabled() || pump_msg_valid ||
+		!bdr_apply_spool_is_empty(bdr_apply_receive_spool()))
+	{
+		bdr_apply_spool_put(bdr_apply_receive_spool(),
+							s->data + s->cursor, s->len - s->cursor);
+		return;
+	}
+
+	bdr_apply_parallel_dispatch(s);
+}
+
+/*
+ * Would bdr_apply_parallel_dispatch() have to wait for parallel apply
+ * workers to commit before it could process 'msg'?
+ */
+static bool
+dispatch_would_block(StringInfo msg)
+{
+	char		action = msg->data[0];
+	int			target;
+
+	/* applied by ourselves right away */
+	if (xact_serial)
+		return false;
+
+	bdr_apply_parallel_collect();
+
+	switch (action)
+	{
+		case 'C':
+			if (xact_barrier)
+				return !bdr_apply_parallel_idle();
+			return !xact_dispatchable(&target);
+		case 'M':
+			if (!xact_open)
+				return !bdr_apply_parallel_idle();
+			break;
+	}
+
+	/* starts applying the transaction ourselves */
+	if (xact_size + msg->len > BDR_APPLY_PARALLEL_MAX_XACT_SIZE)
+		return !bdr_apply_parallel_idle();
+
+	return false;
+}
+
+/*
+ * Dispatch spooled messages for as long as that doesn't require waiting for
+ * parallel apply workers to commit, see bdr_apply_spool.c.
+ */
+void
+bdr_apply_parallel_pump(void)
+{
+	for (;;)
+	{
+		if (!pump_msg_valid)
+		{
+			if (pump_msg.data == NULL)
+			{
+				MemoryContext oldcontext;
+
+				oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+				initStringInfo(&pump_msg);
+				MemoryContextSwitchTo(oldcontext);
+			}
+
+			if (!bdr_apply_spool_get(bdr_apply_receive_spool(), &pump_msg))
+				break;
+			pump_msg_valid = true;
+		}
+
+		if (dispatch_would_block(&pump_msg))
+			break;
+
+		pump_msg.cursor = 0;
+		bdr_apply_parallel_dispatch(&pump_msg);
+		pump_msg_valid = false;
+	}
+}
+
+/*
+ * Is anything received not committed yet, including transactions still in
+ * the spool?
+ */
+bool
+bdr_apply_parallel_has_pending(void)
+{
+	return !bdr_apply_parallel_idle() || pump_msg_valid ||
+		!bdr_apply_spool_is_empty(bdr_apply_receive_spool());
+}
+
+/*
+ * Note that we've begun to apply the dispatched transaction, so the workers
+ * applying later ones can tell whether we're stuck on a lock.
+ */
+void
+bdr_apply_parallel_xact_started(void)
+{
+	BdrApplyParallelRunning *running;
+
+	running = &parallel_shared->running[worker_xact_seq %
+										BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	running->seq = worker_xact_seq;
+	running->worker = worker_index;
+	SpinLockRelease(&parallel_shared->mutex);
+}
+
+/*
+ * Is a worker applying one of the transactions between 'next_commit_seq'
+ * and ours waiting for a lock? It may be one we hold.
+ */
+static bool
+earlier_xact_waits_for_lock(uint64 next_commit_seq)
+{
+	uint64		seq;
+
+	for (seq = next_commit_seq; seq < worker_xact_seq; seq++)
+	{
+		BdrApplyParallelRunning *running;
+		volatile PGPROC *proc = NULL;
+
+		running = &parallel_shared->running[seq %
+											BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+
+		SpinLockAcquire(&parallel_shared->mutex);
+		if (running->seq == seq)
+			proc = parallel_shared->worker_procs[running->worker];
+		SpinLockRelease(&parallel_shared->mutex);
+
+		/* read without the lock partition's lock, but that's just a hint */
+		if (proc != NULL && proc->waitLock != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Wait till all transactions the upstream committed before the one we're
+ * applying are committed locally.
+ *
+ * An earlier transaction may be blocked on a lock we hold, and we don't wait
+ * for it in a way the deadlock detector could see. So if any of them waits
+ * for a lock for deadlock_timeout while we have written something, we error
+ * out, and bdr_apply_parallel_worker_main() applies our transaction again
+ * once the earlier ones committed. The earliest transaction is never rolled
+ * back that way, so there's always progress.
+ */
+void
+bdr_apply_parallel_wait_turn(void)
+{
+	TimestampTz lock_wait_start = 0;
+
+	for (;;)
+	{
+		uint64		next_commit_seq;
+		bool		aborted;
+		long		timeout = 1000L;
+		int			rc;
+
+		SpinLockAcquire(&parallel_shared->mutex);
+		next_commit_seq = parallel_shared->next_commit_seq;
+		aborted = parallel_shared->aborted;
+		SpinLockRelease(&parallel_shared->mutex);
+
+		if (aborted)
+			ereport(ERROR,
+					(errmsg("bdr parallel apply aborted, another apply process exited")));
+
+		if (next_commit_seq == worker_xact_seq)
+			break;
+
+		Assert(next_commit_seq < worker_xact_seq);
+
+		/* without an xid nobody can be waiting for our rows */
+		if (TransactionIdIsValid(GetTopTransactionIdIfAny()) &&
+			earlier_xact_waits_for_lock(next_commit_seq))
+		{
+			if (lock_wait_start == 0)
+				lock_wait_start = GetCurrentTimestamp();
+			else if (TimestampDifferenceExceeds(lock_wait_start,
+												GetCurrentTimestamp(),
+												DeadlockTimeout))
+				ereport(ERROR,
+						(errcode(ERRCODE_T_R_DEADLOCK_DETECTED),
+						 errmsg("rolling back remote transaction waiting to commit while an earlier one waits for a lock")));
+
+			/* the latch isn't set when it starts or stops waiting */
+			timeout = 10L;
+		}
+		else
+			lock_wait_start = 0;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   timeout);
+
+		ResetLatch(&MyProc->procLatch);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* our transaction gets rolled back, the apply worker notices us gone */
+		if (got_SIGTERM)
+			proc_exit(0);
+	}
+}
+
+/*
+ * Record the commit of the transaction we applied and let the next one
+ * commit.
+ */
+void
+bdr_apply_parallel_commit_done(XLogRecPtr remote_end, XLogRecPtr local_end)
+{
+	BdrApplyParallelCommit *commit;
+	int			i;
+
+	/* we don't own the cached identifier, the apply worker does */
+	AdvanceReplicationIdentifier(replication_origin_id, remote_end,
+								 XactLastCommitEnd);
+
+	commit = &parallel_shared->commits[worker_xact_seq %
+									   BDR_APPLY_PARALLEL_MAX_INFLIGHT];
+
+	worker_xact_committed = true;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	commit->remote_end = remote_end;
+	commit->local_end = local_end;
+	parallel_shared->next_commit_seq++;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	for (i = 0; i < parallel_shared->nworkers; i++)
+	{
+		if (i != worker_index && parallel_shared->worker_procs[i] != NULL)
+			SetLatch(&parallel_shared->worker_procs[i]->procLatch);
+	}
+	SetLatch(&parallel_shared->dispatcher_latch);
+}
+
+/*
+ * Entry point for a parallel apply worker.
+ *
+ * Sets up the same state as the apply worker it's started by, then applies
+ * the transactions received from it until it exits.
+ */
+/*
+ * Roll back the transaction being applied after an error, if it's one we
+ * apply again: it was rolled back in bdr_apply_parallel_wait_turn() or by
+ * the deadlock detector. Called in PG_CATCH(); returns false if the error is
+ * to be rethrown, ending the worker and with it all of parallel apply.
+ */
+static bool
+worker_xact_retry(void)
+{
+	MemoryContext oldcontext;
+	ErrorData  *edata;
+	int			sqlerrcode;
+
+	if (got_SIGTERM || worker_xact_committed ||
+		worker_xact_retries >= bdr_apply_max_retries)
+		return false;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	edata = CopyErrorData();
+	MemoryContextSwitchTo(oldcontext);
+	sqlerrcode = edata->sqlerrcode;
+	FreeErrorData(edata);
+
+	if (sqlerrcode != ERRCODE_T_R_DEADLOCK_DETECTED)
+		return false;
+
+	bdr_count_retry_conflict();
+
+	HOLD_INTERRUPTS();
+
+	EmitErrorReport();
+
+	if (IsTransactionState())
+		bdr_count_rollback();
+	AbortOutOfAnyTransaction();
+
+	MemoryContextSwitchTo(TopMemoryContext);
+	FlushErrorState();
+
+	bdr_apply_reset_state();
+
+	RESUME_INTERRUPTS();
+
+	worker_xact_retries++;
+
+	elog(LOG, "applying remote transaction again (attempt %d of %d)",
+		 worker_xact_retries, bdr_apply_max_retries);
+
+	return true;
+}
+
+/*
+ * Apply a message of the dispatched transaction. A copy is kept, so the
+ * whole transaction can be applied again after it rolled back, once the
+ * transactions before it committed.
+ */
+static void
+worker_apply_message(StringInfo s)
+{
+	MemoryContext oldcontext;
+	StringInfo	copy;
+	volatile bool replay = false;
+	volatile bool retry;
+
+	oldcontext = MemoryContextSwitchTo(WorkerXactContext);
+	copy = makeStringInfo();
+	appendBinaryStringInfo(copy, s->data, s->len);
+	worker_xact_messages = lappend(worker_xact_messages, copy);
+	MemoryContextSwitchTo(oldcontext);
+
+	do
+	{
+		retry = false;
+
+		PG_TRY();
+		{
+			if (!replay)
+				bdr_process_remote_action(s);
+			else
+			{
+				ListCell   *lc;
+
+				/* nobody can wait for us now, so this doesn't error out */
+				bdr_apply_parallel_wait_turn();
+
+				foreach(lc, worker_xact_messages)
+				{
+					StringInfo	msg = (StringInfo) lfirst(lc);
+					StringInfoData again;
+
+					/* applying may replace the buffer, keep ours intact */
+					MemoryContextSwitchTo(MessageContext);
+					initStringInfo(&again);
+					appendBinaryStringInfo(&again, msg->data, msg->len);
+
+					bdr_process_remote_action(&again);
+
+					MemoryContextResetAndDeleteChildren(MessageContext);
+				}
+			}
+		}
+		PG_CATCH();
+		{
+			if (!worker_xact_retry())
+				PG_RE_THROW();
+			replay = retry = true;
+		}
+		PG_END_TRY();
+	} while (retry);
+}
+
+void
+bdr_apply_parallel_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	BdrApplyParallelShared *shared;
+	BdrWorker  *apply;
+
+	/* Establish signal handlers before unblocking signals. */
+	pqsignal(SIGHUP, bdr_sighup);
+	pqsignal(SIGTERM, bdr_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "bdr parallel apply top-level resource owner");
+	bdr_saved_resowner = CurrentResourceOwner;
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment for bdr parallel apply")));
+	dsm_keep_mapping(seg);
+
+	toc = shm_toc_attach(BDR_APPLY_PARALLEL_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("bad magic number in dynamic shared memory segment for bdr parallel apply")));
+
+	shared = shm_toc_lookup(toc, BDR_APPLY_PARALLEL_KEY_SHARED);
+
+	bdr_apply_parallel_is_worker = true;
+	parallel_seg = seg;
+	parallel_shared = shared;
+	on_dsm_detach(seg, bdr_apply_parallel_detach, (Datum) 0);
+
+	SpinLockAcquire(&shared->mutex);
+	worker_index = shared->nattached++;
+	SpinLockRelease(&shared->mutex);
+
+	if (worker_index >= shared->nworkers)
+		elog(ERROR, "too many bdr parallel apply workers attached");
+
+	mq = shm_toc_lookup(toc, worker_index + 1);
+	shm_mq_set_receiver(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	/* Connect to our database */
+	BackgroundWorkerInitializeConnectionByOid(shared->dboid, InvalidOid);
+
+	bdr_bgworker_set_session_options(BDR_WORKER_APPLY);
+
+	origin_sysid = shared->origin_sysid;
+	origin_timeline = shared->origin_timeline;
+	origin_dboid = shared->origin_dboid;
+	replication_origin_id = shared->replication_identifier;
+
+	bdr_count_set_current_node(shared->replication_identifier);
+
+	apply = &BdrWorkerCtl->slots[shared->apply_slot];
+	bdr_apply_attach_worker(&apply->data.apply);
+
+	bdr_conflict_logging_startup();
+
+	MessageContext = AllocSetContextCreate(TopMemoryContext,
+										   "MessageContext",
+										   ALLOCSET_DEFAULT_MINSIZE,
+										   ALLOCSET_DEFAULT_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+
+	WorkerXactContext = AllocSetContextCreate(TopMemoryContext,
+											  "bdr parallel apply transaction",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+
+	/* tell the apply worker we're ready */
+	SpinLockAcquire(&shared->mutex);
+	shared->worker_procs[worker_index] = MyProc;
+	shared->nready++;
+	SpinLockRelease(&shared->mutex);
+	SetLatch(&shared->dispatcher_latch);
+
+	/* mark as idle, before starting to loop */
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	while (!got_SIGTERM)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+		StringInfoData s;
+		int			rc;
+
+		/*
+		 * Don't block in shm_mq_receive(), it doesn't return when we're
+		 * asked to exit.
+		 */
+		res = shm_mq_receive(mqh, &nbytes, &data, true);
+
+		if (res == SHM_MQ_WOULD_BLOCK)
+		{
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_POSTMASTER_DEATH, 0L);
+
+			ResetLatch(&MyProc->procLatch);
+
+			/* emergency bailout if postmaster has died */
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			CHECK_FOR_INTERRUPTS();
+			continue;
+		}
+
+		/* the apply worker exited */
+		if (res != SHM_MQ_SUCCESS)
+			break;
+
+		if (got_SIGHUP)
+		{
+			got_SIGHUP = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		MemoryContextSwitchTo(MessageContext);
+
+		/* the queue's buffer isn't terminated, nor aligned */
+		initStringInfo(&s);
+		appendBinaryStringInfo(&s, data, nbytes);
+
+		if (s.data[0] == 'S')
+		{
+			pq_getmsgbyte(&s);
+			worker_xact_seq = pq_getmsgint64(&s);
+			worker_xact_committed = false;
+			worker_xact_retries = 0;
+			worker_xact_messages = NIL;
+			MemoryContextReset(WorkerXactContext);
+		}
+		else
+			worker_apply_message(&s);
+
+		MemoryContextResetAndDeleteChildren(MessageContext);
+	}
+
+	proc_exit(0);
+}
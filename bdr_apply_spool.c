@@ -0,0 +1,222 @@
+/* -------------------------------------------------------------------------
+ *
+ * bdr_apply_spool.c
+ *		Spools for changes received but not applied yet
+ *
+ * With bdr.apply_spool_memory set, the apply worker only receives the
+ * change stream and puts each message into a FIFO spool; applying happens in
+ * parallel apply workers which get the messages from the spool as fast as
+ * they can take them, see bdr_apply_parallel_pump(). Receiving thus doesn't
+ * stall while applying has to wait for locks.
+ *
+ * With an apply delay, received transactions are held back in a spool of
+ * their own until they're due, see bdr_apply_work().
+ *
+ * Messages are kept in memory up to the spool's memory limit, later ones go
+ * to a temporary file until that's been read completely again. The file is
+ * subject to temp_file_limit.
+ *
+ * Copyright (C) 2012-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		bdr_apply_spool.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "bdr.h"
+
+#include "lib/ilist.h"
+
+#include "storage/buffile.h"
+
+#include "utils/memutils.h"
+
+typedef struct BdrSpoolChunk
+{
+	dlist_node	node;
+	int			len;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} BdrSpoolChunk;
+
+struct BdrApplySpool
+{
+	MemoryContext context;
+
+	/* memory limit in kB, a GUC */
+	int		   *memory_kb;
+
+	/* oldest messages, in memory */
+	dlist_head	mem;
+	Size		mem_bytes;
+
+	/* messages received after memory was full, all newer than those in memory */
+	BufFile    *file;
+	uint64		file_msgs;
+	int			read_fileno;
+	off_t		read_off;
+	int			write_fileno;
+	off_t		write_off;
+};
+
+/* the spool in front of the parallel apply workers */
+static BdrApplySpool *receive_spool = NULL;
+
+bool
+bdr_apply_spool_enabled(void)
+{
+	return bdr_apply_spool_memory > 0;
+}
+
+/*
+ * Get the spool messages go through on their way to the parallel apply
+ * workers.
+ */
+BdrApplySpool *
+bdr_apply_receive_spool(void)
+{
+	if (receive_spool == NULL)
+		receive_spool = bdr_apply_spool_create("BDR apply spool",
+											   &bdr_apply_spool_memory);
+	return receive_spool;
+}
+
+/*
+ * Create a spool that keeps up to *memory_kb kB of messages in memory.
+ *
+ * Spools live till the end of the process.
+ */
+BdrApplySpool *
+bdr_apply_spool_create(const char *name, int *memory_kb)
+{
+	BdrApplySpool *spool;
+
+	spool = MemoryContextAllocZero(TopMemoryContext, sizeof(BdrApplySpool));
+	spool->context = AllocSetContextCreate(TopMemoryContext,
+										   name,
+										   ALLOCSET_DEFAULT_MINSIZE,
+										   ALLOCSET_DEFAULT_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+	spool->memory_kb = memory_kb;
+	dlist_init(&spool->mem);
+
+	return spool;
+}
+
+bool
+bdr_apply_spool_is_empty(BdrApplySpool *spool)
+{
+	return dlist_is_empty(&spool->mem) && spool->file_msgs == 0;
+}
+
+/*
+ * Memory taken by the messages in the spool, not counting the file.
+ */
+Size
+bdr_apply_spool_memory_used(BdrApplySpool *spool)
+{
+	return spool->mem_bytes;
+}
+
+/*
+ * Append a message to the spool.
+ */
+void
+bdr_apply_spool_put(BdrApplySpool *spool, const char *data, int len)
+{
+	if (spool->file_msgs == 0 &&
+		spool->mem_bytes + len <= (Size) *spool->memory_kb * 1024L)
+	{
+		BdrSpoolChunk *chunk;
+
+		chunk = MemoryContextAlloc(spool->context,
+								   offsetof(BdrSpoolChunk, data) + len);
+		chunk->len = len;
+		memcpy(chunk->data, data, len);
+		dlist_push_tail(&spool->mem, &chunk->node);
+		spool->mem_bytes += len;
+		return;
+	}
+
+	if (spool->file == NULL)
+	{
+		/* spans transactions */
+		spool->file = BufFileCreateTemp(true);
+		spool->read_fileno = spool->write_fileno = 0;
+		spool->read_off = spool->write_off = 0;
+	}
+
+	if (BufFileSeek(spool->file, spool->write_fileno, spool->write_off,
+					SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in apply spool file: %m")));
+
+	if (BufFileWrite(spool->file, &len, sizeof(len)) != sizeof(len) ||
+		BufFileWrite(spool->file, (void *) data, len) != len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to apply spool file: %m")));
+
+	BufFileTell(spool->file, &spool->write_fileno, &spool->write_off);
+	spool->file_msgs++;
+}
+
+/*
+ * Remove the oldest message from the spool and store it in 'msg'.
+ *
+ * Returns false if the spool is empty.
+ */
+bool
+bdr_apply_spool_get(BdrApplySpool *spool, StringInfo msg)
+{
+	int			len;
+
+	resetStringInfo(msg);
+
+	if (!dlist_is_empty(&spool->mem))
+	{
+		BdrSpoolChunk *chunk;
+
+		chunk = dlist_container(BdrSpoolChunk, node,
+								dlist_pop_head_node(&spool->mem));
+		appendBinaryStringInfo(msg, chunk->data, chunk->len);
+		spool->mem_bytes -= chunk->len;
+		pfree(chunk);
+		return true;
+	}
+
+	if (spool->file_msgs == 0)
+		return false;
+
+	if (BufFileSeek(spool->file, spool->read_fileno, spool->read_off,
+					SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in apply spool file: %m")));
+
+	if (BufFileRead(spool->file, &len, sizeof(len)) != sizeof(len))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from apply spool file: %m")));
+
+	enlargeStringInfo(msg, len);
+	if (BufFileRead(spool->file, msg->data, len) != len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from apply spool file: %m")));
+	msg->len = len;
+	msg->data[len] = '\0';
+
+	BufFileTell(spool->file, &spool->read_fileno, &spool->read_off);
+
+	/* read everything, give the disk space back */
+	if (--spool->file_msgs == 0)
+	{
+		BufFileClose(spool->file);
+		spool->file = NULL;
+	}
+
+	return true;
+}
@@ -360,14 +360,30 @@ bdr_fetch_sysid_via_node_id(RepNodeId node_id, uint64 *sysid, TimeLineID *tli,
 		TimeLineID remote_tli;
 		Oid local_dboid;
 		NameData replication_name;
+		uint32 generation;
 
-		GetReplicationInfoByIdentifier(node_id, false, &riname);
-
-		if (sscanf(riname, BDR_NODE_ID_FORMAT,
-				   &remote_sysid, &remote_tli, &remote_dboid, &local_dboid,
-				   NameStr(replication_name)) != 4)
-			elog(ERROR, "could not parse sysid: %s", riname);
-		pfree(riname);
+		if (!bdr_node_identity_get(node_id, &remote_sysid, &remote_tli,
+								   &remote_dboid, &local_dboid))
+		{
+			generation = bdr_node_identity_generation();
+
+			GetReplicationInfoByIdentifier(node_id, false, &riname);
+
+			if (sscanf(riname, BDR_NODE_ID_FORMAT,
+					   &remote_sysid, &remote_tli, &remote_dboid, &local_dboid,
+					   NameStr(replication_name)) != 4)
+				elog(ERROR, "could not parse sysid: %s", riname);
+			pfree(riname);
+
+			/*
+			 * In the output plugin the catalog is read as of the transaction
+			 * being decoded, which may be long gone; only share what the
+			 * current catalog says.
+			 */
+			if (!HistoricSnapshotActive())
+				bdr_node_identity_set(node_id, generation, remote_sysid,
+									  remote_tli, remote_dboid, local_dboid);
+		}
 
 		if (local_dboid != MyDatabaseId)
 		{
@@ -528,7 +528,7 @@ bdr_conflict_handlers_check_handler_fun(Relation rel, Oid proc_oid)
  * and handler type; ch_type may be NULL, in this case only handlers without
  * specified handler type are returned.
  */
-static void
+void
 bdr_get_conflict_handlers(BDRRelation * rel)
 {
 	Oid			argtypes[1];
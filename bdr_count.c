@@ -43,6 +43,9 @@ typedef struct BdrCountSlot
 {
 	RepNodeId	node_id;
 
+	/* protects the counters, parallel apply workers share their slot */
+	slock_t		mutex;
+
 	/* we use int64 to make sure we can export to sql, there is uint64 there */
 	int64		nr_commit;
 	int64		nr_rollback;
@@ -55,6 +58,22 @@ typedef struct BdrCountSlot
 	int64		nr_delete_conflict;
 
 	int64		nr_disconnect;
+
+	/* heap blocks prefetched, changes whose row was in one of them */
+	int64		nr_prefetch;
+	int64		nr_prefetch_hit;
+
+	/* replies sent to the upstream */
+	int64		nr_feedback;
+
+	/* errors applying was retried after without restarting, by cause */
+	int64		nr_retry_connection;
+	int64		nr_retry_conflict;
+	int64		nr_retry_lock;
+
+	/* compressed messages received: their size, and the uncompressed one */
+	int64		nr_compressed_bytes;
+	int64		nr_compressed_raw_bytes;
 }	BdrCountSlot;
 
 /*
@@ -81,7 +100,7 @@ typedef struct BdrCountSerialize
 static const uint32 bdr_count_magic = 0x5e51A7;
 
 /* everytime the stored data format changes, increase */
-static const uint32 bdr_count_version = 2;
+static const uint32 bdr_count_version = 3;
 
 /* shortcut for the finding BdrCountControl in memory */
 static BdrCountControl *BdrCountCtl = NULL;
@@ -101,7 +120,9 @@ static Size bdr_count_shmem_size(void);
 static void bdr_count_serialize(void);
 static void bdr_count_unserialize(void);
 
-#define BDR_COUNT_STAT_COLS 12
+#define BDR_COUNT_STAT_COLS 20
+/* pg_stat_get_bdr() before extension version 1.0.3.0 */
+#define BDR_COUNT_STAT_COLS_OLD 12
 
 PGDLLEXPORT Datum pg_stat_get_bdr(PG_FUNCTION_ARGS);
 
@@ -137,6 +158,7 @@ static void
 bdr_count_shmem_startup(void)
 {
 	bool		found;
+	size_t		i;
 
 	if (prev_shmem_startup_hook != NULL)
 		prev_shmem_startup_hook();
@@ -151,6 +173,10 @@ bdr_count_shmem_startup(void)
 		memset(BdrCountCtl, 0, bdr_count_shmem_size());
 		BdrCountCtl->lock = LWLockAssign();
 		bdr_count_unserialize();
+
+		/* the file contains the spinlocks as well, whatever state they had */
+		for (i = 0; i < bdr_count_nnodes; i++)
+			SpinLockInit(&BdrCountCtl->slots[i].mutex);
 	}
 	LWLockRelease(AddinShmemInitLock);
 
@@ -223,70 +249,114 @@ out:
 /*
  * Statistic manipulation functions.
  *
- * We assume we don't have to do any locking for *our* slot since only one
- * backend will do writing there.
+ * The parallel apply workers of an apply worker count into its slot, so
+ * several backends may be writing there concurrently.
  */
+#define BDR_COUNT_ADD(field, n) \
+	do { \
+		volatile BdrCountSlot *slot_; \
+		Assert(MyCountOffsetIdx != -1); \
+		slot_ = &BdrCountCtl->slots[MyCountOffsetIdx]; \
+		SpinLockAcquire(&slot_->mutex); \
+		slot_->field += (n); \
+		SpinLockRelease(&slot_->mutex); \
+	} while (0)
+
 void
 bdr_count_commit(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_commit++;
+	BDR_COUNT_ADD(nr_commit, 1);
 }
 
 void
 bdr_count_rollback(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_rollback++;
+	BDR_COUNT_ADD(nr_rollback, 1);
 }
 
 void
 bdr_count_insert(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_insert++;
+	BDR_COUNT_ADD(nr_insert, 1);
 }
 
 void
 bdr_count_insert_conflict(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_insert_conflict++;
+	BDR_COUNT_ADD(nr_insert_conflict, 1);
 }
 
 void
 bdr_count_update(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_update++;
+	BDR_COUNT_ADD(nr_update, 1);
 }
 
 void
 bdr_count_update_conflict(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_update_conflict++;
+	BDR_COUNT_ADD(nr_update_conflict, 1);
 }
 
 void
 bdr_count_delete(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_delete++;
+	BDR_COUNT_ADD(nr_delete, 1);
 }
 
 void
 bdr_count_delete_conflict(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_delete_conflict++;
+	BDR_COUNT_ADD(nr_delete_conflict, 1);
 }
 
 void
 bdr_count_disconnect(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_disconnect++;
+	BDR_COUNT_ADD(nr_disconnect, 1);
+}
+
+void
+bdr_count_prefetch(void)
+{
+	BDR_COUNT_ADD(nr_prefetch, 1);
+}
+
+void
+bdr_count_prefetch_hit(void)
+{
+	BDR_COUNT_ADD(nr_prefetch_hit, 1);
+}
+
+void
+bdr_count_feedback(void)
+{
+	BDR_COUNT_ADD(nr_feedback, 1);
+}
+
+void
+bdr_count_retry_connection(void)
+{
+	BDR_COUNT_ADD(nr_retry_connection, 1);
+}
+
+void
+bdr_count_retry_conflict(void)
+{
+	BDR_COUNT_ADD(nr_retry_conflict, 1);
+}
+
+void
+bdr_count_retry_lock(void)
+{
+	BDR_COUNT_ADD(nr_retry_lock, 1);
+}
+
+void
+bdr_count_compressed(Size compressed, Size raw)
+{
+	BDR_COUNT_ADD(nr_compressed_bytes, compressed);
+	BDR_COUNT_ADD(nr_compressed_raw_bytes, raw);
 }
 
 Datum
@@ -315,7 +385,8 @@ pg_stat_get_bdr(PG_FUNCTION_ARGS)
 	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
 		elog(ERROR, "return type must be a row type");
 
-	if (tupdesc->natts != BDR_COUNT_STAT_COLS)
+	if (tupdesc->natts != BDR_COUNT_STAT_COLS &&
+		tupdesc->natts != BDR_COUNT_STAT_COLS_OLD)
 		elog(ERROR, "wrong function definition");
 
 	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
@@ -334,17 +405,24 @@ pg_stat_get_bdr(PG_FUNCTION_ARGS)
 	for (current_offset = 0; current_offset < bdr_count_nnodes;
 		 current_offset++)
 	{
-		BdrCountSlot *slot;
+		volatile BdrCountSlot *shared_slot;
+		BdrCountSlot copy;
+		BdrCountSlot *slot = &copy;
 		char	   *riname;
 		Datum		values[BDR_COUNT_STAT_COLS];
 		bool		nulls[BDR_COUNT_STAT_COLS];
 
-		slot = &BdrCountCtl->slots[current_offset];
+		shared_slot = &BdrCountCtl->slots[current_offset];
 
 		/* no stats here */
-		if (slot->node_id == InvalidRepNodeId)
+		if (shared_slot->node_id == InvalidRepNodeId)
 			continue;
 
+		/* don't read counters half-written by a concurrent increment */
+		SpinLockAcquire(&shared_slot->mutex);
+		memcpy(&copy, (BdrCountSlot *) shared_slot, sizeof(BdrCountSlot));
+		SpinLockRelease(&shared_slot->mutex);
+
 		memset(values, 0, sizeof(values));
 		memset(nulls, 0, sizeof(nulls));
 
@@ -363,6 +441,19 @@ pg_stat_get_bdr(PG_FUNCTION_ARGS)
 		values[10] = Int64GetDatumFast(slot->nr_delete_conflict);
 		values[11] = Int64GetDatumFast(slot->nr_disconnect);
 
+		/* the columns added in 1.0.3.0, unless the extension is older */
+		if (tupdesc->natts > BDR_COUNT_STAT_COLS_OLD)
+		{
+			values[12] = Int64GetDatumFast(slot->nr_prefetch);
+			values[13] = Int64GetDatumFast(slot->nr_prefetch_hit);
+			values[14] = Int64GetDatumFast(slot->nr_feedback);
+			values[15] = Int64GetDatumFast(slot->nr_retry_connection);
+			values[16] = Int64GetDatumFast(slot->nr_retry_conflict);
+			values[17] = Int64GetDatumFast(slot->nr_retry_lock);
+			values[18] = Int64GetDatumFast(slot->nr_compressed_bytes);
+			values[19] = Int64GetDatumFast(slot->nr_compressed_raw_bytes);
+		}
+
 		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
 	LWLockRelease(BdrCountCtl->lock);
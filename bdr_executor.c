@@ -19,10 +19,12 @@
 #include "bdr.h"
 
 #include "access/heapam.h"
+#include "access/relscan.h"
 #include "access/skey.h"
 #include "access/xact.h"
 #include "access/xlog_fn.h"
 
+#include "catalog/index.h"
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
 #include "catalog/pg_namespace.h"
@@ -72,6 +74,9 @@ static bool bdr_always_allow_writes = false;
 bool in_bdr_replicate_ddl_command = false;
 static List *bdr_truncated_tables = NIL;
 
+/* BDRApplyRelStates built in the current transaction */
+static dlist_head bdr_apply_relstates = DLIST_STATIC_INIT(bdr_apply_relstates);
+
 
 PGDLLEXPORT Datum bdr_queue_truncate(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(bdr_queue_truncate);
@@ -146,8 +151,65 @@ UserTableUpdateOpenIndexes(EState *estate, TupleTableSlot *slot)
 	list_free(recheckIndexes);
 }
 
+/*
+ * Insert index entries for a newly inserted tuple like
+ * UserTableUpdateOpenIndexes(), but instead of raising an error if a unique
+ * index already contains the key, or waiting for a transaction that might
+ * insert it, return false.
+ *
+ * This allows inserting remote tuples first and only looking for conflicting
+ * rows when there actually is one. On false, index entries for the tuple
+ * may have been inserted already, so the caller has to undo the insert,
+ * without leaving a trace in the decoded WAL, see insert_batch_flush().
+ */
+bool
+UserTableTryInsertOpenIndexes(EState *estate, TupleTableSlot *slot)
+{
+	ResultRelInfo *relinfo = estate->es_result_relation_info;
+	ExprContext *econtext = GetPerTupleExprContext(estate);
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+	int			i;
+
+	/* for index expressions and predicates, as in ExecInsertIndexTuples() */
+	econtext->ecxt_scantuple = slot;
+
+	for (i = 0; i < relinfo->ri_NumIndices; i++)
+	{
+		Relation	idxrel = relinfo->ri_IndexRelationDescs[i];
+		IndexInfo  *ii = relinfo->ri_IndexRelationInfo[i];
+		bool		unique;
+
+		if (idxrel == NULL || !ii->ii_ReadyForInserts)
+			continue;
+
+		if (ii->ii_Predicate != NIL)
+		{
+			if (ii->ii_PredicateState == NIL)
+				ii->ii_PredicateState = (List *)
+					ExecPrepareExpr((Expr *) ii->ii_Predicate, estate);
+
+			if (!ExecQual(ii->ii_PredicateState, econtext, false))
+				continue;
+		}
+
+		FormIndexDatum(ii, slot, estate, values, isnull);
+
+		unique = index_insert(idxrel, values, isnull,
+							  &slot->tts_tuple->t_self,
+							  relinfo->ri_RelationDesc,
+							  idxrel->rd_index->indisunique ?
+							  UNIQUE_CHECK_PARTIAL : UNIQUE_CHECK_NO);
+		if (!unique)
+			return false;
+	}
+
+	return true;
+}
+
 void
-build_index_scan_keys(EState *estate, ScanKey *scan_keys, BDRTupleData *tup)
+build_index_scan_keys(BDRRelation *rel, EState *estate, ScanKey *scan_keys,
+					  BDRTupleData *tup)
 {
 	ResultRelInfo *relinfo;
 	int i;
@@ -175,10 +237,9 @@ build_index_scan_keys(EState *estate, ScanKey *scan_keys, BDRTupleData *tup)
 		/*
 		 * Only return index if we could build a key without NULLs.
 		 */
-		if (build_index_scan_key(scan_keys[i],
-								  relinfo->ri_RelationDesc,
-								  relinfo->ri_IndexRelationDescs[i],
-								  tup))
+		if (build_index_scan_key(scan_keys[i], rel,
+								 relinfo->ri_IndexRelationDescs[i],
+								 tup))
 		{
 			pfree(scan_keys[i]);
 			scan_keys[i] = NULL;
@@ -188,21 +249,44 @@ build_index_scan_keys(EState *estate, ScanKey *scan_keys, BDRTupleData *tup)
 }
 
 /*
- * Setup a ScanKey for a search in the relation 'rel' for a tuple 'key' that
- * is setup to match 'rel' (*NOT* idxrel!).
- *
- * Returns whether any column contains NULLs.
+ * Scan keys for a lookup via an index of a relation, with everything but the
+ * arguments already filled in. Kept in the bdr relcache entry of the indexed
+ * relation, so the catalog lookups only have to be done once for each index
+ * until the relation is invalidated.
  */
-bool
-build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, BDRTupleData *tup)
+typedef struct BDRScanKeyTemplate
 {
+	struct BDRScanKeyTemplate *next;
+
+	Oid			indexoid;
+	int			nkeys;
+	/* attribute numbers of the indexed columns in the heap */
+	AttrNumber	heapattnos[INDEX_MAX_KEYS];
+	ScanKeyData	keys[INDEX_MAX_KEYS];
+} BDRScanKeyTemplate;
+
+/*
+ * Look up, or build, the scan key template for index 'idxrel' of 'rel'.
+ */
+static BDRScanKeyTemplate *
+get_index_scan_key_template(BDRRelation *rel, Relation idxrel)
+{
+	BDRScanKeyTemplate *template;
+	MemoryContext oldcontext;
 	int			attoff;
 	Datum		indclassDatum;
 	Datum		indkeyDatum;
 	bool		isnull;
 	oidvector  *opclass;
 	int2vector  *indkey;
-	bool		hasnulls = false;
+
+	for (template = rel->scankey_templates;
+		 template != NULL;
+		 template = template->next)
+	{
+		if (template->indexoid == RelationGetRelid(idxrel))
+			return template;
+	}
 
 	indclassDatum = SysCacheGetAttr(INDEXRELID, idxrel->rd_indextuple,
 									Anum_pg_index_indclass, &isnull);
@@ -214,15 +298,21 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, BDRTupleData *
 	Assert(!isnull);
 	indkey = (int2vector *) DatumGetPointer(indkeyDatum);
 
+	/* the sk_func's live as long as the template */
+	oldcontext = MemoryContextSwitchTo(bdr_relcache_cxt(rel));
 
-	for (attoff = 0; attoff < RelationGetNumberOfAttributes(idxrel); attoff++)
+	template = palloc0(sizeof(BDRScanKeyTemplate));
+	template->indexoid = RelationGetRelid(idxrel);
+	template->nkeys = RelationGetNumberOfAttributes(idxrel);
+
+	for (attoff = 0; attoff < template->nkeys; attoff++)
 	{
 		Oid			operator;
 		Oid			opfamily;
 		RegProcedure regop;
 		int			pkattno = attoff + 1;
 		int			mainattno = indkey->values[attoff];
-		Oid			atttype = attnumTypeId(rel, mainattno);
+		Oid			atttype = attnumTypeId(rel->rel, mainattno);
 		Oid			optype = get_opclass_input_type(opclass->values[attoff]);
 
 		opfamily = get_opclass_family(opclass->values[attoff]);
@@ -239,11 +329,52 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, BDRTupleData *
 		regop = get_opcode(operator);
 
 		/* FIXME: convert type? */
-		ScanKeyInit(&skey[attoff],
+		ScanKeyInit(&template->keys[attoff],
 					pkattno,
 					BTEqualStrategyNumber,
 					regop,
-					tup->values[mainattno - 1]);
+					(Datum) 0);
+
+		template->heapattnos[attoff] = mainattno;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	template->next = rel->scankey_templates;
+	rel->scankey_templates = template;
+
+	return template;
+}
+
+/*
+ * Setup a ScanKey for a search in the relation 'rel' for a tuple 'key' that
+ * is setup to match 'rel' (*NOT* idxrel!).
+ *
+ * Returns whether any column contains NULLs.
+ */
+bool
+build_index_scan_key(ScanKey skey, BDRRelation *rel, Relation idxrel, BDRTupleData *tup)
+{
+	BDRScanKeyTemplate *template;
+	int			attoff;
+	bool		hasnulls = false;
+
+	template = get_index_scan_key_template(rel, idxrel);
+
+	memcpy(skey, template->keys, template->nkeys * sizeof(ScanKeyData));
+
+	for (attoff = 0; attoff < template->nkeys; attoff++)
+	{
+		int			mainattno = template->heapattnos[attoff];
+
+		/*
+		 * Don't let the comparison function cache anything in the template's
+		 * long lived memory; the copy only lives as long as the lookup.
+		 */
+		fmgr_info_copy(&skey[attoff].sk_func, &template->keys[attoff].sk_func,
+					   CurrentMemoryContext);
+
+		skey[attoff].sk_argument = tup->values[mainattno - 1];
 
 		if (tup->isnull[mainattno - 1])
 		{
@@ -254,6 +385,51 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, BDRTupleData *
 	return hasnulls;
 }
 
+/*
+ * Get the SnapshotDirty scan on 'idxrel', one of the indexes opened for the
+ * apply executor state 'state', starting it if it's the first lookup in the
+ * index this transaction. Returns NULL if 'idxrel' isn't one of them.
+ *
+ * Scans are kept open till the state is released, so a transaction updating
+ * many rows of a relation only has to set up one per index.
+ */
+static IndexScanDesc
+relstate_index_scan(BDRApplyRelState *state, Relation idxrel)
+{
+	ResultRelInfo *relinfo = state->estate->es_result_relation_info;
+	MemoryContext oldcontext;
+	int			i;
+
+	for (i = 0; i < relinfo->ri_NumIndices; i++)
+	{
+		if (relinfo->ri_IndexRelationDescs[i] == idxrel)
+			break;
+	}
+
+	if (i == relinfo->ri_NumIndices)
+		return NULL;
+
+	if (state->index_scans[i] != NULL)
+		return state->index_scans[i];
+
+	oldcontext = MemoryContextSwitchTo(state->estate->es_query_cxt);
+
+	if (state->dirty_snapshot == NULL)
+	{
+		state->dirty_snapshot = palloc0(sizeof(SnapshotData));
+		InitDirtySnapshot(*state->dirty_snapshot);
+	}
+
+	state->index_scans[i] = index_beginscan(relinfo->ri_RelationDesc, idxrel,
+											state->dirty_snapshot,
+											RelationGetNumberOfAttributes(idxrel),
+											0);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return state->index_scans[i];
+}
+
 /*
  * Search the index 'idxrel' for a tuple identified by 'skey' in 'rel'.
  *
@@ -266,15 +442,26 @@ find_pkey_tuple(ScanKey skey, BDRRelation *rel, Relation idxrel,
 {
 	HeapTuple	scantuple;
 	bool		found;
-	IndexScanDesc scan;
+	IndexScanDesc scan = NULL;
 	SnapshotData snap;
+	Snapshot	dirty;
 	TransactionId xwait;
+	bool		own_scan = false;
 
-	InitDirtySnapshot(snap);
-	scan = index_beginscan(rel->rel, idxrel,
-						   &snap,
-						   RelationGetNumberOfAttributes(idxrel),
-						   0);
+	/* reuse the scan of the apply executor state, if there is one */
+	if (rel->apply_state != NULL)
+		scan = relstate_index_scan(rel->apply_state, idxrel);
+
+	if (scan == NULL)
+	{
+		own_scan = true;
+		InitDirtySnapshot(snap);
+		scan = index_beginscan(rel->rel, idxrel,
+							   &snap,
+							   RelationGetNumberOfAttributes(idxrel),
+							   0);
+	}
+	dirty = scan->xs_snapshot;
 
 retry:
 	found = false;
@@ -288,8 +475,8 @@ retry:
 		ExecStoreTuple(scantuple, slot, InvalidBuffer, false);
 		ExecMaterializeSlot(slot);
 
-		xwait = TransactionIdIsValid(snap.xmin) ?
-			snap.xmin : snap.xmax;
+		xwait = TransactionIdIsValid(dirty->xmin) ?
+			dirty->xmin : dirty->xmax;
 
 		if (TransactionIdIsValid(xwait))
 		{
@@ -334,11 +521,221 @@ retry:
 		}
 	}
 
-	index_endscan(scan);
+	if (own_scan)
+		index_endscan(scan);
 
 	return found;
 }
 
+/*
+ * Issue prefetch requests for the heap blocks of the tuples identified by
+ * 'skey' in 'rel', so that a later find_pkey_tuple() doesn't have to wait
+ * for them to be read.
+ *
+ * The index itself is searched synchronously; its upper levels are usually
+ * cached anyway. Visibility isn't checked, that's left to the actual lookup,
+ * so this may prefetch dead versions of the row as well.
+ *
+ * Stores up to 'maxblocks' prefetched block numbers in 'blocks' and returns
+ * how many it stored.
+ */
+int
+prefetch_pkey_tuple(ScanKey skey, BDRRelation *rel, Relation idxrel,
+					BlockNumber *blocks, int maxblocks)
+{
+	IndexScanDesc scan;
+	ItemPointer tid;
+	int			nblocks = 0;
+
+	scan = index_beginscan(rel->rel, idxrel, SnapshotAny,
+						   RelationGetNumberOfAttributes(idxrel),
+						   0);
+	index_rescan(scan, skey, RelationGetNumberOfAttributes(idxrel), NULL, 0);
+
+	while (nblocks < maxblocks &&
+		   (tid = index_getnext_tid(scan, ForwardScanDirection)) != NULL)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(tid);
+
+		if (nblocks > 0 && blocks[nblocks - 1] == blkno)
+			continue;
+
+		PrefetchBuffer(rel->rel, MAIN_FORKNUM, blkno);
+		blocks[nblocks++] = blkno;
+	}
+
+	index_endscan(scan);
+
+	return nblocks;
+}
+
+static void
+bdr_apply_relstate_xact_callback(XactEvent event, void *arg)
+{
+	dlist_mutable_iter iter;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			/* release everything before the resource owner complains */
+			bdr_apply_relstate_release_all();
+			break;
+		case XACT_EVENT_ABORT:
+			/*
+			 * Abort processing releases the relcache references, index locks
+			 * and buffer pins and frees TopTransactionContext, so all that's
+			 * left to do is to forget about the states.
+			 */
+			dlist_foreach_modify(iter, &bdr_apply_relstates)
+			{
+				BDRApplyRelState *state;
+
+				state = dlist_container(BDRApplyRelState, node, iter.cur);
+				state->bdrrel->apply_state = NULL;
+			}
+			dlist_init(&bdr_apply_relstates);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Get the executor state used to apply changes to 'rel', building it on the
+ * first change to the relation in the current transaction.
+ *
+ * The state, consisting of an EState whose ResultRelInfo has the relation's
+ * indexes opened and the tuple slots used by the apply functions, is kept
+ * until the transaction ends or the relation's bdr relcache entry gets
+ * rebuilt. Callers are expected to clear the slots once they're done with a
+ * change, the tuples in them usually live in shorter lived memory.
+ */
+BDRApplyRelState *
+bdr_apply_relstate_get(BDRRelation *rel)
+{
+	static bool registered = false;
+	BDRApplyRelState *state;
+	ResultRelInfo *relinfo;
+	MemoryContext oldcontext;
+	Oid			replident;
+	int			i;
+
+	Assert(IsTransactionState());
+
+	if (rel->apply_state != NULL)
+	{
+		state = rel->apply_state;
+		ResetPerTupleExprContext(state->estate);
+		return state;
+	}
+
+	if (!registered)
+	{
+		RegisterXactCallback(bdr_apply_relstate_xact_callback, NULL);
+		registered = true;
+	}
+
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+
+	state = palloc0(sizeof(BDRApplyRelState));
+	state->bdrrel = rel;
+	state->estate = bdr_create_rel_estate(rel->rel);
+
+	/*
+	 * The BDRRelation's Relation gets reset by bdr_heap_close(), so keep our
+	 * own reference to the relcache entry the EState points to.
+	 */
+	RelationIncrementReferenceCount(rel->rel);
+
+	MemoryContextSwitchTo(state->estate->es_query_cxt);
+
+	relinfo = state->estate->es_result_relation_info;
+	ExecOpenIndices(relinfo);
+
+	state->newslot = ExecInitExtraTupleSlot(state->estate);
+	ExecSetSlotDescriptor(state->newslot, RelationGetDescr(rel->rel));
+	state->oldslot = ExecInitExtraTupleSlot(state->estate);
+	ExecSetSlotDescriptor(state->oldslot, RelationGetDescr(rel->rel));
+
+	if (relinfo->ri_NumIndices > 0)
+		state->index_scans = palloc0(sizeof(IndexScanDesc) *
+									 relinfo->ri_NumIndices);
+
+	/* ExecOpenIndices() made sure rd_replidindex is valid */
+	replident = rel->rel->rd_replidindex;
+	state->optimistic_insert = true;
+	for (i = 0; i < relinfo->ri_NumIndices; i++)
+	{
+		Relation	idxrel = relinfo->ri_IndexRelationDescs[i];
+		IndexInfo  *ii = relinfo->ri_IndexRelationInfo[i];
+
+		if (OidIsValid(replident) && RelationGetRelid(idxrel) == replident)
+			state->replident_index = idxrel;
+
+		/* exclusion and deferred constraints need the regular checks */
+		if (ii->ii_ExclusionOps != NULL || !idxrel->rd_index->indimmediate)
+			state->optimistic_insert = false;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	dlist_push_tail(&bdr_apply_relstates, &state->node);
+	rel->apply_state = state;
+
+	return state;
+}
+
+/*
+ * Release the apply executor state of 'rel', if it has one.
+ */
+void
+bdr_apply_relstate_release(BDRRelation *rel)
+{
+	BDRApplyRelState *state = rel->apply_state;
+	ResultRelInfo *relinfo;
+	int			i;
+
+	if (state == NULL)
+		return;
+
+	relinfo = state->estate->es_result_relation_info;
+
+	/* the scans hold references to the indexes */
+	for (i = 0; i < relinfo->ri_NumIndices; i++)
+	{
+		if (state->index_scans[i] != NULL)
+			index_endscan(state->index_scans[i]);
+	}
+
+	ExecCloseIndices(relinfo);
+	ExecResetTupleTable(state->estate->es_tupleTable, true);
+	RelationDecrementReferenceCount(relinfo->ri_RelationDesc);
+	FreeExecutorState(state->estate);
+
+	dlist_delete(&state->node);
+	rel->apply_state = NULL;
+	pfree(state);
+}
+
+/*
+ * Release the apply executor state of all relations. Has to be done before
+ * committing and before executing anything (like DDL) that could change the
+ * relations behind our back.
+ */
+void
+bdr_apply_relstate_release_all(void)
+{
+	dlist_mutable_iter iter;
+
+	dlist_foreach_modify(iter, &bdr_apply_relstates)
+	{
+		BDRApplyRelState *state;
+
+		state = dlist_container(BDRApplyRelState, node, iter.cur);
+		bdr_apply_relstate_release(state->bdrrel);
+	}
+}
+
 /*
  * bdr_queue_ddl_command
  *
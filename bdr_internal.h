@@ -63,7 +63,6 @@ typedef struct BdrConnectionConfig
 
 typedef struct BdrFlushPosition
 {
-	dlist_node node;
 	XLogRecPtr local_end;
 	XLogRecPtr remote_end;
 } BdrFlushPosition;
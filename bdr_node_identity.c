@@ -0,0 +1,309 @@
+/* -------------------------------------------------------------------------
+ *
+ * bdr_node_identity.c
+ *		shmem registry mapping replication identifiers to node identities
+ *
+ * bdr_fetch_sysid_via_node_id() is used on hot paths, like for every
+ * forwarded transaction in the output plugin and for timestamp ties in
+ * last-update-wins conflict resolution. Looking the replication identifier
+ * up in the catalog and parsing its name every time is expensive, so the
+ * results are kept here, in an array indexed by RepNodeId. RepNodeIds are
+ * handed out densely from 1, so the array can be small; identifiers beyond
+ * its end are simply always looked up.
+ *
+ * The perdb workers enter all identifiers at startup and again whenever
+ * replication identifiers are created or dropped, which forgets all entries,
+ * see bdr_node_identity_fill(). Walsenders only ever look identifiers up
+ * with a historic snapshot while decoding, which mustn't be shared, so they
+ * depend on that. Other backends also enter identifiers they look up using
+ * the current catalog.
+ *
+ * Readers don't take any lock: every entry has a change counter that's odd
+ * while the entry is being written, so a reader that sees it odd or changed
+ * after reading the entry just reads it again.
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		bdr_node_identity.c
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "bdr.h"
+
+#include "miscadmin.h"
+
+#include "access/xact.h"
+
+#include "executor/spi.h"
+
+#include "storage/barrier.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+
+#include "utils/builtins.h"
+#include "utils/inval.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+
+#define BDR_NODE_IDENTITY_SLOTS 1024
+
+typedef struct BdrNodeIdentity
+{
+	/* odd while the entry is changed */
+	uint32		changecount;
+	bool		valid;
+	uint64		sysid;
+	TimeLineID	timeline;
+	Oid			dboid;
+	/* database the identifier belongs to */
+	Oid			local_dboid;
+} BdrNodeIdentity;
+
+typedef struct BdrNodeIdentityControl
+{
+	/* serializes writers */
+	slock_t		mutex;
+	/* increased on every invalidation */
+	uint32		generation;
+	BdrNodeIdentity nodes[BDR_NODE_IDENTITY_SLOTS];
+} BdrNodeIdentityControl;
+
+static BdrNodeIdentityControl *BdrNodeIdentityCtl = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void bdr_node_identity_shmem_startup(void);
+static void bdr_node_identity_invalidate(Datum arg, int cacheid,
+										 uint32 hashvalue);
+
+void
+bdr_node_identity_shmem_init(void)
+{
+	Assert(process_shared_preload_libraries_in_progress);
+
+	RequestAddinShmemSpace(sizeof(BdrNodeIdentityControl));
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = bdr_node_identity_shmem_startup;
+
+	/* inherited by all backends */
+	CacheRegisterSyscacheCallback(REPLIDIDENT, bdr_node_identity_invalidate,
+								  (Datum) 0);
+}
+
+static void
+bdr_node_identity_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook != NULL)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	BdrNodeIdentityCtl = ShmemInitStruct("bdr_node_identity",
+										 sizeof(BdrNodeIdentityControl),
+										 &found);
+	if (!found)
+	{
+		memset(BdrNodeIdentityCtl, 0, sizeof(BdrNodeIdentityControl));
+		SpinLockInit(&BdrNodeIdentityCtl->mutex);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * A replication identifier has been created or dropped; identifiers of
+ * dropped ones may be reused, so forget all entries, and have the perdb
+ * workers enter them again.
+ */
+static void
+bdr_node_identity_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+	volatile BdrNodeIdentityControl *ctl = BdrNodeIdentityCtl;
+	int			i;
+
+	if (ctl == NULL)
+		return;
+
+	SpinLockAcquire(&ctl->mutex);
+	ctl->generation++;
+	for (i = 0; i < BDR_NODE_IDENTITY_SLOTS; i++)
+	{
+		volatile BdrNodeIdentity *node = &ctl->nodes[i];
+
+		if (!node->valid)
+			continue;
+
+		node->changecount++;
+		pg_write_barrier();
+		node->valid = false;
+		pg_write_barrier();
+		node->changecount++;
+	}
+	SpinLockRelease(&ctl->mutex);
+
+	if (BdrWorkerCtl == NULL)
+		return;
+
+	LWLockAcquire(BdrWorkerCtl->lock, LW_SHARED);
+	for (i = 0; i < bdr_max_workers; i++)
+	{
+		BdrWorker  *w = &BdrWorkerCtl->slots[i];
+
+		/* see bdr_perdb_xact_callback() about stale latches */
+		if (w->worker_type == BDR_WORKER_PERDB &&
+			w->data.perdb.proclatch != NULL)
+			SetLatch(w->data.perdb.proclatch);
+	}
+	LWLockRelease(BdrWorkerCtl->lock);
+}
+
+/*
+ * Enter all BDR replication identifiers into the registry. Called by the
+ * perdb workers, outside a transaction, whenever the generation differs from
+ * the one returned last time. If identifiers are invalidated meanwhile,
+ * nothing is entered, and the caller will see a new generation.
+ */
+uint32
+bdr_node_identity_fill(void)
+{
+	uint32		generation;
+	int			ret;
+	uint32		i;
+
+	generation = bdr_node_identity_generation();
+
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	ret = SPI_execute("SELECT riident, riname\n"
+					  "FROM pg_catalog.pg_replication_identifier",
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI error while querying pg_replication_identifier");
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	desc = SPI_tuptable->tupdesc;
+		bool		isnull;
+		RepNodeId	node_id;
+		char	   *riname;
+		uint64		remote_sysid;
+		TimeLineID	remote_tli;
+		Oid			remote_dboid;
+		Oid			local_dboid;
+		NameData	replication_name;
+
+		node_id = DatumGetObjectId(SPI_getbinval(tuple, desc, 1, &isnull));
+		riname = TextDatumGetCString(SPI_getbinval(tuple, desc, 2, &isnull));
+
+		/* not all identifiers are BDR's */
+		if (sscanf(riname, BDR_NODE_ID_FORMAT,
+				   &remote_sysid, &remote_tli, &remote_dboid, &local_dboid,
+				   NameStr(replication_name)) == 4)
+			bdr_node_identity_set(node_id, generation, remote_sysid,
+								  remote_tli, remote_dboid, local_dboid);
+		pfree(riname);
+	}
+
+	PopActiveSnapshot();
+	SPI_finish();
+	CommitTransactionCommand();
+
+	return generation;
+}
+
+/*
+ * Get the generation to pass to bdr_node_identity_set() after looking up an
+ * identifier, so a concurrent invalidation isn't lost.
+ */
+uint32
+bdr_node_identity_generation(void)
+{
+	volatile BdrNodeIdentityControl *ctl = BdrNodeIdentityCtl;
+	uint32		generation;
+
+	SpinLockAcquire(&ctl->mutex);
+	generation = ctl->generation;
+	SpinLockRelease(&ctl->mutex);
+
+	return generation;
+}
+
+/*
+ * Look up the identity of the node with local replication identifier
+ * 'node_id'. Returns false if it's not known yet.
+ */
+bool
+bdr_node_identity_get(RepNodeId node_id, uint64 *sysid, TimeLineID *timeline,
+					  Oid *dboid, Oid *local_dboid)
+{
+	volatile BdrNodeIdentity *node;
+	uint32		before;
+	bool		valid;
+
+	if (BdrNodeIdentityCtl == NULL || node_id >= BDR_NODE_IDENTITY_SLOTS)
+		return false;
+
+	node = &BdrNodeIdentityCtl->nodes[node_id];
+
+	for (;;)
+	{
+		before = node->changecount;
+		pg_read_barrier();
+
+		valid = node->valid;
+		*sysid = node->sysid;
+		*timeline = node->timeline;
+		*dboid = node->dboid;
+		*local_dboid = node->local_dboid;
+
+		pg_read_barrier();
+		if (before % 2 == 0 && node->changecount == before)
+			break;
+
+		/* being written right now */
+		SPIN_DELAY();
+	}
+
+	return valid;
+}
+
+/*
+ * Remember the identity of the node with replication identifier 'node_id',
+ * unless an invalidation happened since 'generation' was obtained.
+ */
+void
+bdr_node_identity_set(RepNodeId node_id, uint32 generation, uint64 sysid,
+					  TimeLineID timeline, Oid dboid, Oid local_dboid)
+{
+	volatile BdrNodeIdentityControl *ctl = BdrNodeIdentityCtl;
+	volatile BdrNodeIdentity *node;
+
+	if (ctl == NULL || node_id >= BDR_NODE_IDENTITY_SLOTS)
+		return;
+
+	node = &ctl->nodes[node_id];
+
+	SpinLockAcquire(&ctl->mutex);
+	if (ctl->generation == generation)
+	{
+		node->changecount++;
+		pg_write_barrier();
+		node->sysid = sysid;
+		node->timeline = timeline;
+		node->dboid = dboid;
+		node->local_dboid = local_dboid;
+		node->valid = true;
+		pg_write_barrier();
+		node->changecount++;
+	}
+	SpinLockRelease(&ctl->mutex);
+}
@@ -12,6 +12,9 @@
  */
 #include "postgres.h"
 
+#include <arpa/inet.h>
+#include <ctype.h>
+
 #include "bdr.h"
 #include "bdr_internal.h"
 #include "miscadmin.h"
@@ -48,8 +51,11 @@
 #include "storage/proc.h"
 
 #include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/pg_lzcompress.h"
 #include "utils/rel.h"
 #include "utils/syscache.h"
 #include "utils/timestamp.h"
@@ -69,6 +75,21 @@ typedef struct
 	bool allow_sendrecv_protocol;
 	bool int_datetime_mismatch;
 	bool forward_changesets;
+	bool use_relmeta_cache;
+	bool compress;
+	bool changed_columns_only;
+
+	/* send messages in batches up to this size, 0 if not */
+	uint32 batch_size;
+	/* a batch has been started in ctx->out */
+	bool batch_open;
+	/* where the record being added to it starts */
+	int record_start;
+	/* a batch while it's sent */
+	StringInfo batch;
+
+	/* where the message or batch being sent starts in ctx->out */
+	int write_start;
 
 	uint32 client_pg_version;
 	uint32 client_pg_catversion;
@@ -109,10 +130,54 @@ static void pg_decode_message(LogicalDecodingContext *ctx,
 							  bool transactional, Size sz,
 							  const char *message);
 
+/* messages shorter than this aren't worth compressing */
+#define BDR_COMPRESS_MIN_SIZE 128
+
+/*
+ * Relations whose metadata has already been sent to the client in this
+ * decoding session, if the client supports relation metadata messages. An
+ * entry is removed when the relation is invalidated, so the metadata gets
+ * sent again before the next change to it.
+ */
+typedef struct BdrRelMetaCacheEntry
+{
+	Oid			relid;			/* hash key */
+	/* the encoding information the metadata was sent for */
+	uint32		encode_build;
+} BdrRelMetaCacheEntry;
+
+static HTAB *RelMetaCache = NULL;
+
+/*
+ * The encoding information kept in BDR's relcache entries, see
+ * prepare_encode_info(), is only valid for this generation. It's increased
+ * when things it depends on change without the relation being invalidated:
+ * when a decoding session with possibly different options starts, and when a
+ * schema is renamed. A changed type only invalidates the relations that use
+ * it, see bdr_relcache_invalidate_encode_info().
+ */
+static uint32 encode_generation = 0;
+
+/* source of BDRRelation.encode_build */
+static uint32 encode_builds = 0;
+
 /* private prototypes */
-static void write_rel(StringInfo out, Relation rel);
-static void write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
-						HeapTuple tuple);
+static void relmeta_cache_init(void);
+static void relmeta_cache_release(void);
+static bool relmeta_cache_needs_send(BDRRelation *r);
+static void encode_info_init(void);
+static void prepare_encode_info(BdrOutputData *data, BDRRelation *r);
+static void decide_datum_transfer(BdrOutputData *data,
+								  Form_pg_attribute att, Form_pg_type typclass,
+								  bool *use_binary, bool *use_sendrecv);
+static bool binary_transfer_allowed(Oid typid);
+static void prepare_write(LogicalDecodingContext *ctx, bool last_write);
+static void finish_write(LogicalDecodingContext *ctx, bool last_write,
+						 bool end_batch);
+static void write_relmeta(StringInfo out, BDRRelation *r);
+static void write_rel(BdrOutputData *data, StringInfo out, BDRRelation *r);
+static void write_tuple(BdrOutputData *data, StringInfo out, BDRRelation *r,
+						HeapTuple tuple, HeapTuple oldtuple);
 
 /* specify output plugin callbacks */
 void
@@ -423,6 +488,28 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 			data->client_db_encoding = pstrdup(strVal(elem->arg));
 		else if (strcmp(elem->defname, "forward_changesets") == 0)
 			bdr_parse_bool(elem, &data->forward_changesets);
+		else if (strcmp(elem->defname, "changed_columns_only") == 0)
+			bdr_parse_bool(elem, &data->changed_columns_only);
+		else if (strcmp(elem->defname, "batch_size") == 0)
+			bdr_parse_uint32(elem, &data->batch_size);
+		else if (strcmp(elem->defname, "compression") == 0)
+		{
+			char	  **methods;
+			int			nmethods;
+			int			i;
+
+			/*
+			 * The compression methods the client can decompress; methods we
+			 * don't know are skipped, so newer clients can offer more.
+			 */
+			bdr_parse_identifier_list_arr(elem, &methods, &nmethods);
+
+			for (i = 0; i < nmethods; i++)
+			{
+				if (strcmp(methods[i], "pglz") == 0)
+					data->compress = true;
+			}
+		}
 		else if (strcmp(elem->defname, "unidirectional") == 0)
 		{
 			bool is_unidirectional;
@@ -482,6 +569,9 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 		}
 	}
 
+	if (data->batch_size > 0)
+		data->batch = makeStringInfo();
+
 	/*
 	 * Ensure that the BDR extension is installed on this database.
 	 *
@@ -596,6 +686,19 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 		if (data->client_pg_version / 100 != PG_VERSION_NUM / 100)
 			data->allow_sendrecv_protocol = false;
 
+		/*
+		 * Identify relations by oid and send their names only once, if the
+		 * client knows how to deal with that.
+		 */
+		if (data->client_bdr_version >= BDR_MIN_RELMETA_VERSION_NUM)
+		{
+			data->use_relmeta_cache = true;
+			relmeta_cache_init();
+		}
+
+		/* the transfer formats chosen above may differ from earlier ones */
+		encode_info_init();
+
 		bdr_maintain_schema(false);
 
 		data->bdr_schema_oid = get_namespace_oid("bdr", true);
@@ -669,10 +772,256 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 static void
 pg_decode_shutdown(LogicalDecodingContext * ctx)
 {
+	relmeta_cache_release();
+
 	/* release and free slot */
 	bdr_worker_shmem_release();
 }
 
+static void
+relmeta_cache_invalidate_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	BdrRelMetaCacheEntry *entry;
+
+	if (RelMetaCache == NULL)
+		return;
+
+	if (relid == InvalidOid)
+	{
+		hash_seq_init(&status, RelMetaCache);
+
+		while ((entry = (BdrRelMetaCacheEntry *) hash_seq_search(&status)) != NULL)
+		{
+			if (hash_search(RelMetaCache, &entry->relid,
+							HASH_REMOVE, NULL) == NULL)
+				elog(ERROR, "hash table corrupted");
+		}
+	}
+	else
+		hash_search(RelMetaCache, &relid, HASH_REMOVE, NULL);
+}
+
+static void
+relmeta_cache_init(void)
+{
+	static bool callback_registered = false;
+	HASHCTL		ctl;
+
+	Assert(RelMetaCache == NULL);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(BdrRelMetaCacheEntry);
+	ctl.hash = tag_hash;
+	ctl.hcxt = TopMemoryContext;
+
+	RelMetaCache = hash_create("BDR relation metadata cache", 128, &ctl,
+							   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	/* a relcache callback can't be unregistered, so only do this once */
+	if (!callback_registered)
+	{
+		CacheRegisterRelcacheCallback(relmeta_cache_invalidate_callback,
+									  (Datum) 0);
+		callback_registered = true;
+	}
+}
+
+static void
+relmeta_cache_release(void)
+{
+	if (RelMetaCache == NULL)
+		return;
+
+	hash_destroy(RelMetaCache);
+	RelMetaCache = NULL;
+}
+
+/*
+ * Does the client still need the metadata for 'r'? Remembers it as sent.
+ *
+ * The metadata includes names of types, so it's also sent again after the
+ * encoding information was rebuilt because a type changed.
+ */
+static bool
+relmeta_cache_needs_send(BDRRelation *r)
+{
+	Oid			relid = RelationGetRelid(r->rel);
+	BdrRelMetaCacheEntry *entry;
+	bool		found;
+
+	entry = hash_search(RelMetaCache, &relid, HASH_ENTER, &found);
+
+	if (found && entry->encode_build == r->encode_build)
+		return false;
+
+	entry->encode_build = r->encode_build;
+	return true;
+}
+
+static void
+encode_info_invalidate_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	encode_generation++;
+}
+
+static void
+encode_info_type_invalidate_callback(Datum arg, int cacheid,
+									 uint32 hashvalue)
+{
+	/* 0 means all types */
+	if (hashvalue == 0)
+		encode_generation++;
+	else
+		bdr_relcache_invalidate_encode_info(hashvalue);
+}
+
+/*
+ * Forget all relations' encoding information.
+ */
+static void
+encode_info_init(void)
+{
+	static bool callback_registered = false;
+
+	encode_generation++;
+
+	/*
+	 * cached schema names are stale after a rename, and the types embedded
+	 * in a column's data after its composite type was altered
+	 */
+	if (!callback_registered)
+	{
+		CacheRegisterSyscacheCallback(NAMESPACEOID,
+									  encode_info_invalidate_callback,
+									  (Datum) 0);
+		CacheRegisterSyscacheCallback(TYPEOID,
+									  encode_info_type_invalidate_callback,
+									  (Datum) 0);
+		callback_registered = true;
+	}
+}
+
+/*
+ * Make sure the encoding information for the relation 'r' is built: its
+ * names and, for every attribute, the transfer format and the function
+ * info for the send/output function. It's kept until the relation is
+ * invalidated or encode_generation changes.
+ */
+static void
+prepare_encode_info(BdrOutputData *data, BDRRelation *r)
+{
+	Relation	rel = r->rel;
+	TupleDesc	desc = RelationGetDescr(rel);
+	BDRAttrEncodeInfo *encode_info;
+	MemoryContext oldcxt;
+	const char *nspname;
+	Bitmapset  *keyattrs;
+	List	   *types;
+	ListCell   *lc;
+	int			i;
+
+	if (r->encode_info != NULL && r->encode_generation == encode_generation)
+		return;
+
+	if (r->encode_cxt == NULL)
+		r->encode_cxt = AllocSetContextCreate(bdr_relcache_cxt(r),
+											  "BDR relation encoding info",
+											  ALLOCSET_SMALL_MINSIZE,
+											  ALLOCSET_SMALL_INITSIZE,
+											  ALLOCSET_SMALL_MAXSIZE);
+	else
+		MemoryContextReset(r->encode_cxt);
+	r->encode_info = NULL;
+
+	nspname = get_namespace_name(rel->rd_rel->relnamespace);
+	if (nspname == NULL)
+		elog(ERROR, "cache lookup failed for namespace %u",
+			 rel->rd_rel->relnamespace);
+
+	oldcxt = MemoryContextSwitchTo(r->encode_cxt);
+
+	r->encode_nspname = pstrdup(nspname);
+	r->encode_nspnamelen = strlen(nspname) + 1;
+	r->encode_relname = pstrdup(NameStr(rel->rd_rel->relname));
+	r->encode_relnamelen = strlen(r->encode_relname) + 1;
+
+	encode_info = palloc0(Max(desc->natts, 1) * sizeof(BDRAttrEncodeInfo));
+	r->encode_typhashes = palloc(Max(desc->natts, 1) * sizeof(uint32));
+	r->encode_ntyphashes = 0;
+
+	keyattrs = RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_KEY);
+	types = NIL;
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = desc->attrs[i];
+		BDRAttrEncodeInfo *info = &encode_info[i];
+		HeapTuple	typtup;
+		Form_pg_type typclass;
+		bool		use_binary = false;
+		bool		use_sendrecv = false;
+
+		/* always sent as null */
+		if (att->attisdropped)
+			continue;
+
+		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
+		if (!HeapTupleIsValid(typtup))
+			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
+		typclass = (Form_pg_type) GETSTRUCT(typtup);
+
+		decide_datum_transfer(data, att, typclass, &use_binary, &use_sendrecv);
+
+		r->encode_typhashes[r->encode_ntyphashes++] =
+			GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(att->atttypid));
+
+		info->typlen = att->attlen;
+		info->typbyval = att->attbyval;
+		info->iskey = bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
+									keyattrs);
+
+		if (use_binary)
+			info->format = 'b';
+		else if (use_sendrecv)
+		{
+			info->format = 's';
+			fmgr_info_cxt(typclass->typsend, &info->finfo, r->encode_cxt);
+
+			if (data->use_relmeta_cache)
+				types = list_concat_unique_oid(types,
+								bdr_embedded_user_types(att->atttypid));
+		}
+		else
+		{
+			info->format = 't';
+			fmgr_info_cxt(typclass->typoutput, &info->finfo, r->encode_cxt);
+		}
+
+		ReleaseSysCache(typtup);
+	}
+
+	r->encode_ntypes = list_length(types);
+	r->encode_types = palloc(Max(r->encode_ntypes, 1) * sizeof(Oid));
+	r->encode_typhashes = repalloc(r->encode_typhashes,
+								   Max(r->encode_ntyphashes + r->encode_ntypes, 1) *
+								   sizeof(uint32));
+	i = 0;
+	foreach(lc, types)
+	{
+		r->encode_types[i++] = lfirst_oid(lc);
+		r->encode_typhashes[r->encode_ntyphashes++] =
+			GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(lfirst_oid(lc)));
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	r->encode_info = encode_info;
+	r->encode_generation = encode_generation;
+	r->encode_build = ++encode_builds;
+}
+
 /*
  * Only changesets generated on the local node should be replicated
  * to the client unless we're in changeset forwarding mode.
@@ -741,7 +1090,7 @@ pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 	if (!should_forward_changeset(ctx, data, txn))
 		return;
 
-	OutputPluginPrepareWrite(ctx, true);
+	prepare_write(ctx, true);
 	pq_sendbyte(ctx->out, 'B');		/* BEGIN */
 
 
@@ -782,7 +1131,7 @@ pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 		pq_sendint64(ctx->out, txn->origin_lsn);
 	}
 
-	OutputPluginWrite(ctx, true);
+	finish_write(ctx, true, false);
 	return;
 }
 
@@ -810,7 +1159,7 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	if (!should_forward_changeset(ctx, data, txn))
 		return;
 
-	OutputPluginPrepareWrite(ctx, true);
+	prepare_write(ctx, true);
 	pq_sendbyte(ctx->out, 'C');		/* sending COMMIT */
 
 	/* send the flags field its self */
@@ -821,7 +1170,7 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	pq_sendint64(ctx->out, txn->end_lsn);
 	pq_sendint64(ctx->out, txn->commit_time);
 
-	OutputPluginWrite(ctx, true);
+	finish_write(ctx, true, true);
 }
 
 void
@@ -845,37 +1194,61 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	if (!should_forward_change(ctx, data, bdr_relation, change->action))
 		return;
 
-	OutputPluginPrepareWrite(ctx, true);
+	prepare_encode_info(data, bdr_relation);
+
+	/* tell the client about the relation first, if necessary */
+	if (data->use_relmeta_cache && relmeta_cache_needs_send(bdr_relation))
+	{
+		prepare_write(ctx, false);
+		write_relmeta(ctx->out, bdr_relation);
+		finish_write(ctx, false, false);
+	}
+
+	prepare_write(ctx, true);
 
 	switch (change->action)
 	{
 		case REORDER_BUFFER_CHANGE_INSERT:
 			pq_sendbyte(ctx->out, 'I');		/* action INSERT */
-			write_rel(ctx->out, relation);
+			write_rel(data, ctx->out, bdr_relation);
 			pq_sendbyte(ctx->out, 'N');		/* new tuple follows */
-			write_tuple(data, ctx->out, relation, &change->data.tp.newtuple->tuple);
+			write_tuple(data, ctx->out, bdr_relation,
+						&change->data.tp.newtuple->tuple, NULL);
 			break;
 		case REORDER_BUFFER_CHANGE_UPDATE:
 			pq_sendbyte(ctx->out, 'U');		/* action UPDATE */
-			write_rel(ctx->out, relation);
+			write_rel(data, ctx->out, bdr_relation);
 			if (change->data.tp.oldtuple != NULL)
 			{
 				pq_sendbyte(ctx->out, 'K');	/* old key follows */
-				write_tuple(data, ctx->out, relation,
-							&change->data.tp.oldtuple->tuple);
+				write_tuple(data, ctx->out, bdr_relation,
+							&change->data.tp.oldtuple->tuple, NULL);
 			}
 			pq_sendbyte(ctx->out, 'N');		/* new tuple follows */
-			write_tuple(data, ctx->out, relation,
-						&change->data.tp.newtuple->tuple);
+
+			/*
+			 * With REPLICA IDENTITY FULL the old tuple has all columns, so
+			 * the unchanged ones can be left out if the client wants that.
+			 * Otherwise there's only the key, if anything.
+			 */
+			if (data->changed_columns_only &&
+				change->data.tp.oldtuple != NULL &&
+				relation->rd_rel->relreplident == REPLICA_IDENTITY_FULL)
+				write_tuple(data, ctx->out, bdr_relation,
+							&change->data.tp.newtuple->tuple,
+							&change->data.tp.oldtuple->tuple);
+			else
+				write_tuple(data, ctx->out, bdr_relation,
+							&change->data.tp.newtuple->tuple, NULL);
 			break;
 		case REORDER_BUFFER_CHANGE_DELETE:
 			pq_sendbyte(ctx->out, 'D');		/* action DELETE */
-			write_rel(ctx->out, relation);
+			write_rel(data, ctx->out, bdr_relation);
 			if (change->data.tp.oldtuple != NULL)
 			{
 				pq_sendbyte(ctx->out, 'K');	/* old key follows */
-				write_tuple(data, ctx->out, relation,
-							&change->data.tp.oldtuple->tuple);
+				write_tuple(data, ctx->out, bdr_relation,
+							&change->data.tp.oldtuple->tuple, NULL);
 			}
 			else
 				pq_sendbyte(ctx->out, 'E');	/* empty */
@@ -883,7 +1256,7 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 		default:
 			Assert(false);
 	}
-	OutputPluginWrite(ctx, true);
+	finish_write(ctx, true, false);
 
 	MemoryContextSwitchTo(old);
 	MemoryContextReset(data->context);
@@ -892,30 +1265,192 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 }
 
 /*
- * Write schema.relation to the output stream.
+ * Like OutputPluginPrepareWrite(), for messages written with finish_write().
+ *
+ * If the client asked for batches, messages are collected in ctx->out as
+ * records of a 'X' message, which is only sent once it's large enough or a
+ * transaction ends. The walsender's header, which says which position the
+ * data goes up to, is put in front then.
  */
 static void
-write_rel(StringInfo out, Relation rel)
+prepare_write(LogicalDecodingContext *ctx, bool last_write)
 {
-	const char *nspname;
-	int64		nspnamelen;
-	const char *relname;
-	int64		relnamelen;
+	BdrOutputData *data = ctx->output_plugin_private;
+	StringInfo	out = ctx->out;
 
-	nspname = get_namespace_name(rel->rd_rel->relnamespace);
-	if (nspname == NULL)
-		elog(ERROR, "cache lookup failed for namespace %u",
-			 rel->rd_rel->relnamespace);
-	nspnamelen = strlen(nspname) + 1;
+	if (data->batch_size == 0)
+	{
+		OutputPluginPrepareWrite(ctx, last_write);
+
+		/* the walsender puts its header in front of the message */
+		data->write_start = out->len;
+		return;
+	}
+
+	if (!data->batch_open)
+	{
+		resetStringInfo(out);
+		pq_sendbyte(out, 'X');	/* batch of messages follows */
+		data->batch_open = true;
+	}
+
+	/* length of the record, filled in by finish_write() */
+	data->record_start = out->len;
+	pq_sendint(out, 0, 4);
+}
+
+/*
+ * Like OutputPluginWrite(), but with batches the message is only added to
+ * the current one, which is sent if 'end_batch' is set, because the client
+ * mustn't wait for more, or it's large enough.
+ *
+ * What's sent is compressed if the client asked for compression and it's
+ * large enough to be worth it. A compressed message is sent as 'Z', the
+ * length of the uncompressed message and the pglz compressed data, without
+ * pglz's header, as that's in native byte order. If you change this, you
+ * must also change decompress_message() and receive_batch() in bdr_apply.c.
+ */
+static void
+finish_write(LogicalDecodingContext *ctx, bool last_write, bool end_batch)
+{
+	BdrOutputData *data = ctx->output_plugin_private;
+	StringInfo	out = ctx->out;
+	int			rawlen;
+	PGLZ_Header *compressed;
+
+	if (data->batch_size > 0)
+	{
+		uint32		reclen = htonl(out->len - data->record_start - 4);
+
+		memcpy(out->data + data->record_start, &reclen, 4);
+
+		if (!end_batch && out->len < data->batch_size)
+			return;
+
+		/* copy the batch behind the header, at the current position */
+		resetStringInfo(data->batch);
+		appendBinaryStringInfo(data->batch, out->data, out->len);
+
+		OutputPluginPrepareWrite(ctx, true);
+		data->write_start = out->len;
+		appendBinaryStringInfo(out, data->batch->data, data->batch->len);
+		data->batch_open = false;
+		last_write = true;
+	}
+
+	rawlen = out->len - data->write_start;
+
+	if (data->compress && rawlen >= BDR_COMPRESS_MIN_SIZE)
+	{
+		compressed = palloc(PGLZ_MAX_OUTPUT(rawlen));
+
+		/* gives up unless it saves a good part of the size */
+		if (pglz_compress(out->data + data->write_start, rawlen, compressed,
+						  PGLZ_strategy_default))
+		{
+			int			clen = VARSIZE(compressed) - sizeof(PGLZ_Header);
+
+			out->len = data->write_start;
+			pq_sendbyte(out, 'Z');		/* compressed message follows */
+			pq_sendint(out, rawlen, 4);
+			appendBinaryStringInfo(out,
+								   (char *) compressed + sizeof(PGLZ_Header),
+								   clen);
+		}
+
+		pfree(compressed);
+	}
+
+	OutputPluginWrite(ctx, last_write);
+}
+
+/*
+ * Write a relation metadata message, telling the client which relation
+ * changes identified by the oid of 'rel' belong to.
+ *
+ * If you change this you must also change process_remote_relation(...) in
+ * bdr_apply.c.
+ */
+static void
+write_relmeta(StringInfo out, BDRRelation *r)
+{
+	int			flags = 0;
+	int			i;
+
+	if (r->encode_ntypes > 0)
+		flags |= BDR_OUTPUT_RELATION_HAS_TYPES;
+
+	pq_sendbyte(out, 'R');		/* sending RELATION metadata */
+
+	/* send the flags field its self */
+	pq_sendint(out, flags, 4);
+
+	pq_sendint(out, RelationGetRelid(r->rel), 4);
+
+	pq_sendint(out, r->encode_nspnamelen, 2);		/* schema name length */
+	appendBinaryStringInfo(out, r->encode_nspname, r->encode_nspnamelen);
+
+	pq_sendint(out, r->encode_relnamelen, 2);		/* table name length */
+	appendBinaryStringInfo(out, r->encode_relname, r->encode_relnamelen);
+
+	if (!(flags & BDR_OUTPUT_RELATION_HAS_TYPES))
+		return;
+
+	/*
+	 * The oids and names of the non-builtin types the send/recv data of the
+	 * relation's columns contains the oids of.
+	 */
+	pq_sendint(out, r->encode_ntypes, 2);
+	for (i = 0; i < r->encode_ntypes; i++)
+	{
+		HeapTuple	typtup;
+		Form_pg_type typclass;
+		const char *nspname;
+		const char *typname;
+
+		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(r->encode_types[i]));
+		if (!HeapTupleIsValid(typtup))
+			elog(ERROR, "cache lookup failed for type %u", r->encode_types[i]);
+		typclass = (Form_pg_type) GETSTRUCT(typtup);
 
-	relname = NameStr(rel->rd_rel->relname);
-	relnamelen = strlen(relname) + 1;
+		nspname = get_namespace_name(typclass->typnamespace);
+		if (nspname == NULL)
+			elog(ERROR, "cache lookup failed for namespace %u",
+				 typclass->typnamespace);
+		typname = NameStr(typclass->typname);
 
-	pq_sendint(out, nspnamelen, 2);		/* schema name length */
-	appendBinaryStringInfo(out, nspname, nspnamelen);
+		pq_sendint(out, r->encode_types[i], 4);
+		pq_sendint(out, strlen(nspname) + 1, 2);	/* schema name length */
+		appendBinaryStringInfo(out, nspname, strlen(nspname) + 1);
+		pq_sendint(out, strlen(typname) + 1, 2);	/* type name length */
+		appendBinaryStringInfo(out, typname, strlen(typname) + 1);
 
-	pq_sendint(out, relnamelen, 2);		/* table name length */
-	appendBinaryStringInfo(out, relname, relnamelen);
+		ReleaseSysCache(typtup);
+	}
+}
+
+/*
+ * Write the identity of the relation to the output stream: either just its
+ * oid, after write_relmeta() has been sent for it, or schema.relation.
+ *
+ * A schema name is at least one byte long because of its terminating NUL, so
+ * a zero length is used to mark the former.
+ */
+static void
+write_rel(BdrOutputData *data, StringInfo out, BDRRelation *r)
+{
+	if (data->use_relmeta_cache)
+	{
+		pq_sendint(out, 0, 2);		/* no schema name, relation oid follows */
+		pq_sendint(out, RelationGetRelid(r->rel), 4);
+		return;
+	}
+
+	pq_sendint(out, r->encode_nspnamelen, 2);		/* schema name length */
+	appendBinaryStringInfo(out, r->encode_nspname, r->encode_nspnamelen);
+
+	pq_sendint(out, r->encode_relnamelen, 2);		/* table name length */
+	appendBinaryStringInfo(out, r->encode_relname, r->encode_relnamelen);
 }
 
 /*
@@ -935,43 +1470,129 @@ decide_datum_transfer(BdrOutputData *data,
 		*use_sendrecv = false;
 	}
 	/*
-	 * Use the binary protocol, if allowed, for builtin & plain datatypes.
+	 * Use the binary protocol, if allowed, for builtin & plain datatypes,
+	 * and for plain datatypes the admin vouches for.
 	 */
 	else if (data->allow_binary_protocol &&
 		typclass->typtype == 'b' &&
-		att->atttypid < FirstNormalObjectId &&
-		typclass->typelem == InvalidOid)
+		typclass->typelem == InvalidOid &&
+		(att->atttypid < FirstNormalObjectId ||
+		 binary_transfer_allowed(att->atttypid)))
 	{
 		*use_binary = true;
 	}
 	/*
 	 * Use send/recv, if allowed, if the type is plain or builtin.
 	 *
-	 * XXX: we can't use send/recv for array or composite types for now due to
-	 * the embedded oids.
+	 * The send/recv representations of arrays and composites embed the oids
+	 * of their element and column types. Clients that get relation metadata
+	 * get the names of the non-builtin ones with it, to map them to their
+	 * own, see write_relmeta(). For other clients only builtin types' oids
+	 * can be relied on.
 	 */
 	else if (data->allow_sendrecv_protocol &&
 			 OidIsValid(typclass->typreceive) &&
-			 (att->atttypid < FirstNormalObjectId || typclass->typtype != 'c') &&
-			 (att->atttypid < FirstNormalObjectId || typclass->typelem == InvalidOid))
+			 (data->use_relmeta_cache ||
+			  att->atttypid < FirstNormalObjectId ||
+			  (typclass->typtype != 'c' && typclass->typelem == InvalidOid)))
 	{
 		*use_sendrecv = true;
 	}
 }
 
+/*
+ * Is the non-builtin type 'typid' listed in bdr.binary_transfer_types?
+ */
+static bool
+binary_transfer_allowed(Oid typid)
+{
+	char	   *typname;
+	char	   *types;
+	char	   *name;
+	bool		found = false;
+
+	if (bdr_binary_transfer_types == NULL ||
+		bdr_binary_transfer_types[0] == '\0')
+		return false;
+
+	/* quoted as necessary, as the list entries have to be */
+	typname = format_type_be_qualified(typid);
+	types = pstrdup(bdr_binary_transfer_types);
+
+	for (name = types; !found && name != NULL;)
+	{
+		char	   *next = strchr(name, ',');
+		char	   *end;
+
+		if (next != NULL)
+			*next++ = '\0';
+
+		while (isspace((unsigned char) *name))
+			name++;
+		end = name + strlen(name);
+		while (end > name && isspace((unsigned char) end[-1]))
+			*--end = '\0';
+
+		found = strcmp(name, typname) == 0;
+		name = next;
+	}
+
+	pfree(types);
+	pfree(typname);
+
+	return found;
+}
+
+/*
+ * Has a column of an updated tuple kept the value it had in the old tuple?
+ *
+ * Only binary equality counts; values compressed in either tuple are
+ * considered changed, as comparing them would require decompressing.
+ */
+static bool
+column_unchanged(BDRAttrEncodeInfo *info, Datum newval, Datum oldval)
+{
+	if (info->typlen == -1)
+	{
+		struct varlena *n = (struct varlena *) DatumGetPointer(newval);
+		struct varlena *o = (struct varlena *) DatumGetPointer(oldval);
+
+		if (VARATT_IS_EXTERNAL(n) || VARATT_IS_COMPRESSED(n) ||
+			VARATT_IS_EXTERNAL(o) || VARATT_IS_COMPRESSED(o))
+			return false;
+
+		/* one of them may have a short header, compare the data only */
+		return VARSIZE_ANY_EXHDR(n) == VARSIZE_ANY_EXHDR(o) &&
+			memcmp(VARDATA_ANY(n), VARDATA_ANY(o), VARSIZE_ANY_EXHDR(n)) == 0;
+	}
+
+	return datumIsEqual(newval, oldval, info->typbyval, info->typlen);
+}
+
 /*
  * Write a tuple to the outputstream, in the most efficient format possible.
+ *
+ * The format of each column has been chosen by prepare_encode_info().
+ *
+ * If 'oldtuple' is passed, the complete previous version of an updated
+ * tuple, columns that kept their value are sent as unchanged, bar those in
+ * unique indexes. The client keeps its local value for them.
  */
 static void
-write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
-			HeapTuple tuple)
+write_tuple(BdrOutputData *data, StringInfo out, BDRRelation *r,
+			HeapTuple tuple, HeapTuple oldtuple)
 {
 	TupleDesc	desc;
+	BDRAttrEncodeInfo *encode_info = r->encode_info;
 	Datum		values[MaxTupleAttributeNumber];
 	bool		isnull[MaxTupleAttributeNumber];
+	Datum	   *oldvalues = NULL;
+	bool	   *oldisnull = NULL;
 	int			i;
 
-	desc = RelationGetDescr(rel);
+	Assert(encode_info != NULL);
+
+	desc = RelationGetDescr(r->rel);
 
 	pq_sendbyte(out, 'T');			/* tuple follows */
 
@@ -988,15 +1609,17 @@ write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
 	 */
 	heap_deform_tuple(tuple, desc, values, isnull);
 
-	for (i = 0; i < desc->natts; i++)
+	if (oldtuple != NULL)
 	{
-		HeapTuple	typtup;
-		Form_pg_type typclass;
+		oldvalues = palloc(desc->natts * sizeof(Datum));
+		oldisnull = palloc(desc->natts * sizeof(bool));
+		heap_deform_tuple(oldtuple, desc, oldvalues, oldisnull);
+	}
 
+	for (i = 0; i < desc->natts; i++)
+	{
 		Form_pg_attribute att = desc->attrs[i];
-
-		bool use_binary = false;
-		bool use_sendrecv = false;
+		BDRAttrEncodeInfo *info = &encode_info[i];
 
 		if (isnull[i] || att->attisdropped)
 		{
@@ -1008,38 +1631,37 @@ write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
 			pq_sendbyte(out, 'u');	/* unchanged toast column */
 			continue;
 		}
+		else if (oldtuple != NULL && !oldisnull[i] && !info->iskey &&
+				 column_unchanged(info, values[i], oldvalues[i]))
+		{
+			pq_sendbyte(out, 'u');	/* unchanged column */
+			continue;
+		}
 
-		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
-		if (!HeapTupleIsValid(typtup))
-			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
-		typclass = (Form_pg_type) GETSTRUCT(typtup);
-
-		decide_datum_transfer(data, att, typclass, &use_binary, &use_sendrecv);
-
-		if (use_binary)
+		if (info->format == 'b')
 		{
 			pq_sendbyte(out, 'b');	/* binary data follows */
 
 			/* pass by value */
-			if (att->attbyval)
+			if (info->typbyval)
 			{
-				pq_sendint(out, att->attlen, 4); /* length */
+				pq_sendint(out, info->typlen, 4); /* length */
 
-				enlargeStringInfo(out, att->attlen);
-				store_att_byval(out->data + out->len, values[i], att->attlen);
-				out->len += att->attlen;
+				enlargeStringInfo(out, info->typlen);
+				store_att_byval(out->data + out->len, values[i], info->typlen);
+				out->len += info->typlen;
 				out->data[out->len] = '\0';
 			}
 			/* fixed length non-varlena pass-by-reference type */
-			else if (att->attlen > 0)
+			else if (info->typlen > 0)
 			{
-				pq_sendint(out, att->attlen, 4); /* length */
+				pq_sendint(out, info->typlen, 4); /* length */
 
 				appendBinaryStringInfo(out, DatumGetPointer(values[i]),
-									   att->attlen);
+									   info->typlen);
 			}
 			/* varlena type */
-			else if (att->attlen == -1)
+			else if (info->typlen == -1)
 			{
 				char *data = DatumGetPointer(values[i]);
 
@@ -1062,15 +1684,14 @@ write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
 			else
 				elog(ERROR, "unsupported tuple type");
 		}
-		else if (use_sendrecv)
+		else if (info->format == 's')
 		{
 			bytea	   *outputbytes;
 			int			len;
 
 			pq_sendbyte(out, 's');	/* 'send' data follows */
 
-			outputbytes =
-				OidSendFunctionCall(typclass->typsend, values[i]);
+			outputbytes = SendFunctionCall(&info->finfo, values[i]);
 
 			len = VARSIZE(outputbytes) - VARHDRSZ;
 			pq_sendint(out, len, 4); /* length */
@@ -1084,15 +1705,12 @@ write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
 
 			pq_sendbyte(out, 't');	/* 'text' data follows */
 
-			outputstr =
-				OidOutputFunctionCall(typclass->typoutput, values[i]);
+			outputstr = OutputFunctionCall(&info->finfo, values[i]);
 			len = strlen(outputstr) + 1;
 			pq_sendint(out, len, 4); /* length */
 			appendBinaryStringInfo(out, outputstr, len); /* data */
 			pfree(outputstr);
 		}
-
-		ReleaseSysCache(typtup);
 	}
 }
 
@@ -1105,11 +1723,12 @@ pg_decode_message(LogicalDecodingContext *ctx,
 	/*
 	 * TODO: at some point we'll need several channels and filtering here..
 	 */
-	OutputPluginPrepareWrite(ctx, true);
+	prepare_write(ctx, true);
 	pq_sendbyte(ctx->out, 'M');	/* message follows */
 	pq_sendbyte(ctx->out, transactional);
 	pq_sendint64(ctx->out, lsn);
 	pq_sendint(ctx->out, sz, 4);
 	pq_sendbytes(ctx->out, message, sz);
-	OutputPluginWrite(ctx, true);
+	/* non-transactional messages aren't followed by a commit */
+	finish_write(ctx, true, !transactional);
 }
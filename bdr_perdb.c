@@ -722,6 +722,7 @@ bdr_perdb_worker_main(Datum main_arg)
 	BdrPerdbWorker		*perdb;
 	StringInfoData		si;
 	bool				wait;
+	uint32				identity_generation;
 
 	initStringInfo(&si);
 
@@ -809,6 +810,9 @@ bdr_perdb_worker_main(Datum main_arg)
 	/* initialize sequencer */
 	bdr_sequencer_init(perdb->seq_slot, perdb->nnodes);
 
+	/* let walsenders find all nodes in the node identity registry */
+	identity_generation = bdr_node_identity_fill();
+
 	while (!got_SIGTERM)
 	{
 		wait = true;
@@ -819,6 +823,10 @@ bdr_perdb_worker_main(Datum main_arg)
 			ProcessConfigFile(PGC_SIGHUP);
 		}
 
+		/* replication identifiers were created or dropped */
+		if (bdr_node_identity_generation() != identity_generation)
+			identity_generation = bdr_node_identity_fill();
+
 		/* check whether we need to start new elections */
 		if (bdr_sequencer_start_elections())
 			wait = false;
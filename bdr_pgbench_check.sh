@@ -15,6 +15,9 @@ if [ ! -n "$RUNTIME" ]; then
     RUNTIME=100
 fi
 
+# settings appended to the configuration, e.g. to compare apply modes
+EXTRACONF="$BDR_PGBENCH_EXTRA_CONF"
+
 #INTERNAL
 TOPBUILDDIR=@top_srcdir@
 BINDIR=@bindir@
@@ -79,6 +82,9 @@ cd $SCRIPTDIR
 $BINDIR/initdb -D $DATADIR/data >>$SCRIPTDIR/bdr_pgbench_check.log 2>&1
 cp $PGCONF $DATADIR/data/postgresql.conf
 cp $HBACONF $DATADIR/data/pg_hba.conf
+if [ -n "$EXTRACONF" ]; then
+	cat "$EXTRACONF" >> $DATADIR/data/postgresql.conf
+fi
 
 $BINDIR/pg_ctl -D $DATADIR/data start -w -l $DATADIR/bdr_pgbench_check_pg.log >>$SCRIPTDIR/bdr_pgbench_check.log 2>&1
 
@@ -139,8 +145,14 @@ for i in `seq 1 $NUM_RUNS`; do
 
 done
 
+# how long applying lags behind once pgbench is done
+CATCHUP_START=$(date +%s)
 $BINDIR/psql -h $PRIMARY_HOST -p $PRIMARY_PORT $PRIMARY_DB -c "SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location()::text, pid) FROM pg_stat_replication;" > /dev/null
 $BINDIR/psql -h $SLAVE_HOST -p $SLAVE_PORT $SLAVE_DB -c "SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location()::text, pid) FROM pg_stat_replication;" > /dev/null
+CATCHUP_END=$(date +%s)
+
+grep '^tps = .*excluding' $SCRIPTDIR/bdr_pgbench_check.log || true
+echo "Apply caught up $(($CATCHUP_END - $CATCHUP_START))s after pgbench finished"
 
 SQL=$(cat <<EOF
 SET search_path=pg_catalog;
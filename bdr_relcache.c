@@ -18,8 +18,11 @@
 
 #include "access/genam.h"
 #include "access/heapam.h"
+#include "access/transam.h"
 #include "access/xact.h"
 
+#include "catalog/pg_type.h"
+
 #include "commands/seclabel.h"
 
 #include "utils/builtins.h"
@@ -29,6 +32,9 @@
 #include "utils/jsonapi.h"
 #include "utils/json.h"
 #include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/typcache.h"
 
 static HTAB *BDRRelcacheHash = NULL;
 
@@ -37,6 +43,13 @@ BDRRelcacheHashInvalidateEntry(BDRRelation *entry)
 {
 	int i;
 
+	/* the relation might have changed, don't reuse apply executor state */
+	bdr_apply_relstate_release(entry);
+
+	/* nor anything else we derived from its definition */
+	if (entry->cache_cxt != NULL)
+		MemoryContextDelete(entry->cache_cxt);
+
 	if (entry->conflict_handlers)
 		pfree(entry->conflict_handlers);
 
@@ -87,6 +100,40 @@ BDRRelcacheHashInvalidateCallback(Datum arg, Oid relid)
 	}
 }
 
+/*
+ * A type changed; make the output plugin rebuild the encoding information of
+ * the relations whose columns depend on it, see prepare_encode_info().
+ * 'typhash' is the type's TYPEOID syscache hash value.
+ */
+void
+bdr_relcache_invalidate_encode_info(uint32 typhash)
+{
+	HASH_SEQ_STATUS status;
+	BDRRelation *entry;
+	int			i;
+
+	if (BDRRelcacheHash == NULL)
+		return;
+
+	hash_seq_init(&status, BDRRelcacheHash);
+
+	while ((entry = (BDRRelation *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->encode_info == NULL)
+			continue;
+
+		for (i = 0; i < entry->encode_ntyphashes; i++)
+		{
+			if (entry->encode_typhashes[i] == typhash)
+			{
+				/* the memory is reused once it's rebuilt */
+				entry->encode_info = NULL;
+				break;
+			}
+		}
+	}
+}
+
 static void
 bdr_relcache_initialize()
 {
@@ -302,6 +349,128 @@ bdr_heap_close(BDRRelation * rel, LOCKMODE lockmode)
 	rel->rel = NULL;
 }
 
+/*
+ * Return the memory context for information derived from the definition of
+ * the open relation 'rel', creating it if necessary.
+ */
+MemoryContext
+bdr_relcache_cxt(BDRRelation *rel)
+{
+	if (rel->cache_cxt == NULL)
+		rel->cache_cxt = AllocSetContextCreate(CacheMemoryContext,
+											   "BDR relation cache entry",
+											   ALLOCSET_SMALL_MINSIZE,
+											   ALLOCSET_SMALL_INITSIZE,
+											   ALLOCSET_SMALL_MAXSIZE);
+
+	return rel->cache_cxt;
+}
+
+static void
+bdr_relcache_alloc_tuple(BDRTupleData *tup, int natts, MemoryContext cxt)
+{
+	natts = Max(natts, 1);
+
+	tup->values = (Datum *) MemoryContextAlloc(cxt, natts * sizeof(Datum));
+	tup->isnull = (bool *) MemoryContextAlloc(cxt, natts * sizeof(bool));
+	tup->changed = (bool *) MemoryContextAlloc(cxt, natts * sizeof(bool));
+}
+
+/*
+ * Return the per-attribute decoding information of the open relation 'rel',
+ * building it if this is the first use since the entry was (re)validated.
+ *
+ * The rel's decode_old/decode_new tuple buffers are allocated alongside.
+ */
+BDRAttrDecodeInfo *
+bdr_relcache_decode_info(BDRRelation *rel)
+{
+	TupleDesc	desc;
+	MemoryContext cxt;
+	int			i;
+
+	if (rel->decode_info != NULL)
+		return rel->decode_info;
+
+	desc = RelationGetDescr(rel->rel);
+	cxt = bdr_relcache_cxt(rel);
+
+	rel->decode_info = (BDRAttrDecodeInfo *)
+		MemoryContextAllocZero(cxt,
+							   Max(desc->natts, 1) * sizeof(BDRAttrDecodeInfo));
+
+	bdr_relcache_alloc_tuple(&rel->decode_old, desc->natts, cxt);
+	bdr_relcache_alloc_tuple(&rel->decode_new, desc->natts, cxt);
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = desc->attrs[i];
+		BDRAttrDecodeInfo *info = &rel->decode_info[i];
+
+		info->typmod = att->atttypmod;
+		info->typlen = att->attlen;
+		info->typbyval = att->attbyval;
+		info->typalign = att->attalign;
+
+		if (!att->attisdropped)
+			info->recv_remap = bdr_embedded_user_types(att->atttypid) != NIL;
+	}
+
+	return rel->decode_info;
+}
+
+static void
+collect_embedded_types(Oid typid, List **types)
+{
+	Oid			basetype = getBaseType(typid);
+	Oid			elemtype = get_element_type(basetype);
+
+	if (OidIsValid(elemtype))
+	{
+		if (elemtype >= FirstNormalObjectId)
+			*types = list_append_unique_oid(*types, elemtype);
+		collect_embedded_types(elemtype, types);
+	}
+	else if (get_typtype(basetype) == TYPTYPE_COMPOSITE)
+	{
+		TupleDesc	desc = lookup_rowtype_tupdesc(basetype, -1);
+		int			i;
+
+		for (i = 0; i < desc->natts; i++)
+		{
+			Form_pg_attribute att = desc->attrs[i];
+
+			if (att->attisdropped)
+				continue;
+
+			if (att->atttypid >= FirstNormalObjectId)
+				*types = list_append_unique_oid(*types, att->atttypid);
+			collect_embedded_types(att->atttypid, types);
+		}
+
+		ReleaseTupleDesc(desc);
+	}
+}
+
+/*
+ * Return the non-builtin types whose oids are part of the send/recv
+ * representation of values of type 'typid': the element types of arrays and
+ * the column types of composites, recursively.
+ *
+ * Builtin types have the same oids on all nodes, other types' oids need to
+ * be mapped to the receiving node's, so the output plugin sends their names,
+ * see write_relmeta().
+ */
+List *
+bdr_embedded_user_types(Oid typid)
+{
+	List	   *types = NIL;
+
+	collect_embedded_types(typid, &types);
+
+	return types;
+}
+
 
 static bool
 relation_in_replication_set(BDRRelation *r, const char *setname)
@@ -68,6 +68,8 @@ bdr_shmem_init(void)
 	bdr_sequencer_shmem_init(bdr_max_databases);
 
 	bdr_locks_shmem_init();
+
+	bdr_node_identity_shmem_init();
 }
 
 /*
@@ -0,0 +1,65 @@
+SET LOCAL search_path = bdr;
+SET bdr.permit_unsafe_ddl_commands = true;
+SET bdr.skip_ddl_replication = true;
+
+--
+-- Add the apply prefetch, feedback, retry and compression counters to
+-- pg_stat_bdr
+--
+DROP VIEW bdr.pg_stat_bdr;
+DROP FUNCTION bdr.pg_stat_get_bdr();
+
+CREATE FUNCTION bdr.pg_stat_get_bdr(
+    OUT rep_node_id oid,
+    OUT rilocalid oid,
+    OUT riremoteid text,
+    OUT nr_commit int8,
+    OUT nr_rollback int8,
+    OUT nr_insert int8,
+    OUT nr_insert_conflict int8,
+    OUT nr_update int8,
+    OUT nr_update_conflict int8,
+    OUT nr_delete int8,
+    OUT nr_delete_conflict int8,
+    OUT nr_disconnect int8,
+    OUT nr_prefetch int8,
+    OUT nr_prefetch_hit int8,
+    OUT nr_feedback int8,
+    OUT nr_retry_connection int8,
+    OUT nr_retry_conflict int8,
+    OUT nr_retry_lock int8,
+    OUT nr_compressed_bytes int8,
+    OUT nr_compressed_raw_bytes int8
+)
+RETURNS SETOF record
+LANGUAGE C
+AS 'MODULE_PATHNAME';
+
+REVOKE ALL ON FUNCTION bdr.pg_stat_get_bdr() FROM PUBLIC;
+
+CREATE VIEW bdr.pg_stat_bdr AS SELECT * FROM bdr.pg_stat_get_bdr();
+
+--
+-- Changes the apply workers have received but not applied yet
+--
+CREATE FUNCTION bdr.bdr_get_apply_received(
+    OUT pid integer,
+    OUT remote_sysid text,
+    OUT remote_timeline oid,
+    OUT remote_dboid oid,
+    OUT received_bytes int8,
+    OUT queued_bytes int8,
+    OUT spooled_bytes int8,
+    OUT forced_resets int8
+)
+RETURNS SETOF record
+LANGUAGE C
+AS 'MODULE_PATHNAME';
+
+REVOKE ALL ON FUNCTION bdr.bdr_get_apply_received() FROM PUBLIC;
+
+CREATE VIEW bdr.bdr_apply_received AS SELECT * FROM bdr.bdr_get_apply_received();
+
+RESET bdr.permit_unsafe_ddl_commands;
+RESET bdr.skip_ddl_replication;
+RESET search_path;
@@ -0,0 +1,44 @@
+conninfo "node1" "dbname=node1"
+conninfo "node2" "dbname=node2"
+conninfo "node3" "dbname=node3"
+
+# Concurrent updates of different columns of a REPLICA IDENTITY FULL table.
+# Run with bdr.stream_changed_columns too, where the left out columns mustn't
+# keep local values when a row changed on another node wins.
+
+setup
+{
+	BEGIN;
+    SET LOCAL bdr.permit_ddl_locking = true;
+	CREATE TABLE test_dmlconflict_cols(a int primary key, b int, c int);
+	ALTER TABLE test_dmlconflict_cols REPLICA IDENTITY FULL;
+	INSERT INTO test_dmlconflict_cols VALUES(1, 0, 0);
+	COMMIT;
+	SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication;
+}
+
+teardown
+{
+    SET bdr.permit_ddl_locking = true;
+	DROP TABLE test_dmlconflict_cols;
+}
+
+
+session "snode1"
+connection "node1"
+step "s1u" { UPDATE test_dmlconflict_cols SET b = 1 WHERE a = 1; }
+step "s1w" { SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication; }
+step "s1s" { SELECT * FROM test_dmlconflict_cols; }
+
+session "snode2"
+connection "node2"
+step "s2u" { UPDATE test_dmlconflict_cols SET c = 2 WHERE a = 1; }
+step "s2w" { SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication; }
+step "s2s" { SELECT * FROM test_dmlconflict_cols; }
+
+session "snode3"
+connection "node3"
+step "s3w" { SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication; }
+step "s3s" { SELECT * FROM test_dmlconflict_cols; }
+
+permutation "s1u" "s2u" "s1w" "s2w" "s3w" "s1s" "s2s" "s3s"
@@ -0,0 +1,65 @@
+-- REPLICA IDENTITY FULL, where updates can be sent with only the changed
+-- columns
+SELECT * FROM public.bdr_regress_variables()
+\gset
+
+\c :writedb1
+
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE TABLE public.replident_full_dml (
+		id integer primary key,
+		other integer,
+		data text,
+		big text
+	);
+	ALTER TABLE public.replident_full_dml REPLICA IDENTITY FULL;
+$$);
+COMMIT;
+
+-- check basic insert replication
+INSERT INTO replident_full_dml(id, other, data, big)
+VALUES (1, 10, 'foo', repeat('a', 3000)),
+       (2, 20, 'bar', repeat('b', 3000)),
+       (3, 30, NULL, NULL),
+       (4, 40, 'qux', repeat('d', 3000));
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb2
+SELECT id, other, data, length(big) AS big_length FROM replident_full_dml ORDER BY id;
+
+-- update single columns, to and from NULL
+\c :writedb2
+UPDATE replident_full_dml SET other = other + 1 WHERE id = 1;
+UPDATE replident_full_dml SET data = NULL WHERE id = 2;
+UPDATE replident_full_dml SET data = 'baz', big = repeat('c', 2000) WHERE id = 3;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb1
+SELECT id, other, data, length(big) AS big_length FROM replident_full_dml ORDER BY id;
+
+-- change the key
+\c :writedb1
+UPDATE replident_full_dml SET id = 5 WHERE id = 4;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb2
+SELECT id, other, data, length(big) AS big_length FROM replident_full_dml ORDER BY id;
+
+-- update multiple rows
+\c :writedb2
+UPDATE replident_full_dml SET data = data || '!' WHERE data IS NOT NULL;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb1
+SELECT id, other, data, length(big) AS big_length FROM replident_full_dml ORDER BY id;
+
+-- delete one row
+\c :writedb1
+DELETE FROM replident_full_dml WHERE id = 1;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb2
+SELECT id, other, data, length(big) AS big_length FROM replident_full_dml ORDER BY id;
+
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$DROP TABLE public.replident_full_dml;$$);
+COMMIT;
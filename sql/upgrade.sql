@@ -105,6 +105,9 @@ DROP EXTENSION bdr;
 CREATE EXTENSION bdr VERSION '1.0.2.0';
 DROP EXTENSION bdr;
 
+CREATE EXTENSION bdr VERSION '1.0.3.0';
+DROP EXTENSION bdr;
+
 -- evolve version one by one from the oldest to the newest one
 CREATE EXTENSION bdr VERSION '0.8.0';
 ALTER EXTENSION bdr UPDATE TO '0.8.0.1';
@@ -165,6 +168,7 @@ ALTER EXTENSION bdr UPDATE TO '0.10.0.11';
 ALTER EXTENSION bdr UPDATE TO '1.0.0.0';
 ALTER EXTENSION bdr UPDATE TO '1.0.1.0';
 ALTER EXTENSION bdr UPDATE TO '1.0.2.0';
+ALTER EXTENSION bdr UPDATE TO '1.0.3.0';
 
 -- Should never have to do anything: You missed adding the new version above.
 ALTER EXTENSION bdr UPDATE;